@@ -0,0 +1,208 @@
+#include "compressed_cache.h"
+#include <assert.h>
+#include <string.h>
+
+/* The initial number of hash buckets. Must be a power of two. */
+#define INITIAL_BUCKETS 64
+/* A block is only kept if it compresses to no more than this many eighths of
+ * its length. */
+#define MAX_RATIO 7
+
+struct compressed_block {
+    ulong id;
+    ulong length;
+    usize_t size;
+    /* The next block in the same hash bucket. */
+    struct compressed_block *chain;
+    /* The neighbours of the block in order of addition, newest first. */
+    struct compressed_block *next;
+    struct compressed_block *previous;
+    /* The compressed data follows the block. */
+};
+
+struct compressed_cache {
+    compressed_block_t **buckets;
+    ulong bucket_mask;
+    ulong count;
+    compressed_block_t *head;
+    compressed_block_t *tail;
+    ulong size;
+    ulong capacity;
+};
+
+static compressed_block_t **find_link(const compressed_cache_t *const cache, const ulong id);
+static void grow_buckets(compressed_cache_t *const cache);
+static void detach_block(compressed_cache_t *const cache, compressed_block_t *const block);
+
+
+compressed_cache_t *compressed_cache_init(const ulong capacity) {
+    compressed_cache_t *cache = malloc(sizeof *cache);
+    assert(capacity != 0);
+    
+    if (cache != NULL) {
+        if ((cache->buckets = calloc(INITIAL_BUCKETS, sizeof(compressed_block_t *))) != NULL) {
+            cache->bucket_mask = INITIAL_BUCKETS - 1;
+            cache->count = 0;
+            cache->head = NULL;
+            cache->tail = NULL;
+            cache->size = 0;
+            cache->capacity = capacity;
+        } else {
+            free(cache);
+            cache = NULL;
+        }
+    }
+    return cache;
+}
+
+
+void compressed_cache_free(compressed_cache_t *const cache) {
+    if (cache == NULL)
+        return;
+    
+    while (cache->head != NULL) {
+        compressed_block_t *const next = cache->head->next;
+        free(cache->head);
+        cache->head = next;
+    }
+    free(cache->buckets);
+    free(cache);
+}
+
+
+int compressed_cache_put(compressed_cache_t *const cache, const ulong id,
+                         const char *const data, const ulong length) {
+    const usize_t limit = (usize_t) (length / 8 * MAX_RATIO);
+    compressed_block_t *block;
+    compressed_block_t *replaced;
+    compressed_block_t **link;
+    usize_t size;
+    
+    // Compress into the largest block worth keeping, then shrink it to fit.
+    if ((limit == 0) || (limit > cache->capacity)
+            || ((block = malloc(sizeof(compressed_block_t) + limit)) == NULL))
+        return 0;
+    if (xd3_encode_memory((const uint8_t *) data, (usize_t) length, NULL, 0,
+            (uint8_t *) (block + 1), &size, limit, XD3_COMPLEVEL_1) != 0) {
+        free(block);
+        return 0;
+    }
+    if (size < limit) {
+        compressed_block_t *const shrunk = realloc(block, sizeof(compressed_block_t) + size);
+        if (shrunk != NULL)
+            block = shrunk;
+    }
+    block->id = id;
+    block->length = length;
+    block->size = size;
+    
+    if ((replaced = *find_link(cache, id)) != NULL) {
+        detach_block(cache, replaced);
+        free(replaced);
+    }
+    // Make room, oldest first.
+    while ((cache->tail != NULL) && (cache->size + size > cache->capacity)) {
+        compressed_block_t *const evicted = cache->tail;
+        detach_block(cache, evicted);
+        free(evicted);
+    }
+    link = find_link(cache, id);
+    block->chain = *link;
+    *link = block;
+    block->previous = NULL;
+    block->next = cache->head;
+    if (cache->head != NULL)
+        cache->head->previous = block;
+    else
+        cache->tail = block;
+    cache->head = block;
+    cache->size += size;
+    if (++cache->count > cache->bucket_mask)
+        grow_buckets(cache);
+    return 1;
+}
+
+
+compressed_block_t *compressed_cache_take(compressed_cache_t *const cache, const ulong id) {
+    compressed_block_t *const block = *find_link(cache, id);
+    if (block != NULL)
+        detach_block(cache, block);
+    return block;
+}
+
+
+long compressed_block_decode(const compressed_block_t *const block, char *const dest,
+                             const ulong capacity) {
+    usize_t length;
+    if (xd3_decode_memory((const uint8_t *) (block + 1), block->size, NULL, 0,
+            (uint8_t *) dest, &length, (usize_t) capacity, 0) != 0)
+        return -1;
+    return (length == block->length) ? (long) length : -1;
+}
+
+
+void compressed_block_free(compressed_block_t *const block) {
+    free(block);
+}
+
+
+ulong compressed_cache_size(const compressed_cache_t *const cache) {
+    return cache->size;
+}
+
+
+/**
+ * Find the link that refers, or would refer, to the block with the given
+ * identifier within its hash bucket.
+ */
+static compressed_block_t **find_link(const compressed_cache_t *const cache, const ulong id) {
+    compressed_block_t **link = &cache->buckets[(id * 2654435761UL) & cache->bucket_mask];
+    while ((*link != NULL) && ((*link)->id != id))
+        link = &(*link)->chain;
+    return link;
+}
+
+
+/**
+ * Double the number of hash buckets. If there is insufficient memory, the
+ * buckets are left as they are, at the cost of longer chains.
+ */
+static void grow_buckets(compressed_cache_t *const cache) {
+    const ulong count = (cache->bucket_mask + 1) * 2;
+    compressed_block_t **const buckets = calloc(count, sizeof(compressed_block_t *));
+    ulong i;
+    if (buckets == NULL)
+        return;
+    
+    for (i = 0; i <= cache->bucket_mask; i++) {
+        while (cache->buckets[i] != NULL) {
+            compressed_block_t *const moved = cache->buckets[i];
+            const ulong bucket = (moved->id * 2654435761UL) & (count - 1);
+            cache->buckets[i] = moved->chain;
+            moved->chain = buckets[bucket];
+            buckets[bucket] = moved;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->bucket_mask = count - 1;
+}
+
+
+/**
+ * Remove a block from the index and the order of addition.
+ */
+static void detach_block(compressed_cache_t *const cache, compressed_block_t *const block) {
+    compressed_block_t **const link = find_link(cache, block->id);
+    *link = block->chain;
+    if (block->previous != NULL)
+        block->previous->next = block->next;
+    else
+        cache->head = block->next;
+    if (block->next != NULL)
+        block->next->previous = block->previous;
+    else
+        cache->tail = block->previous;
+    cache->size -= block->size;
+    cache->count--;
+}
@@ -0,0 +1,111 @@
+/* 
+ * File:   compressed_cache.h
+ * Author: Michael Winter <mail@michael-winter.me.uk>
+ *
+ * Created on 16 October 2026, 20:40
+ */
+
+#ifndef COMPRESSED_CACHE_H
+#define	COMPRESSED_CACHE_H
+
+#include "config.h"
+
+#include "xdelta3.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+    typedef unsigned long ulong;
+
+    /**
+     * A second-tier cache that keeps blocks compressed in memory, so that a
+     * block evicted from a cache of uncompressed blocks can be restored
+     * without fetching it again.
+     * 
+     * Blocks are compressed by the xdelta3 engine at its fastest setting,
+     * without a source or secondary compression. Blocks that do not compress
+     * well are not kept. Once the compressed data exceeds the capacity of the
+     * cache, the least recently added blocks are discarded.
+     * 
+     * A cache is not thread-safe, and does not use the Python interpreter.
+     */
+    typedef struct compressed_cache compressed_cache_t;
+
+    /**
+     * A block removed from a compressed cache by compressed_cache_take.
+     */
+    typedef struct compressed_block compressed_block_t;
+
+    /**
+     * Allocate and initialise a compressed cache.
+     * 
+     * @param capacity the number of bytes of compressed data the cache may
+     *                 hold. Cannot be zero (0).
+     * @return the cache on success; NULL if there was insufficient memory.
+     */
+    compressed_cache_t *compressed_cache_init(const ulong capacity);
+    /**
+     * Deallocate a compressed cache and the blocks stored therein.
+     * 
+     * @param cache a pointer to the cache to deallocate.
+     */
+    void compressed_cache_free(compressed_cache_t *const cache);
+
+    /**
+     * Compress a block and add it to the cache, replacing any block with the
+     * same identifier.
+     * 
+     * @param cache a pointer to the cache to populate.
+     * @param id the identifier of the block.
+     * @param data a pointer to the content of the block.
+     * @param length the length of the block.
+     * @return non-zero if the block was added; zero (0) if it did not compress
+     *         well or there was insufficient memory.
+     */
+    int compressed_cache_put(compressed_cache_t *const cache, const ulong id,
+                             const char *const data, const ulong length);
+    /**
+     * Remove a block from the cache so that it can be decompressed. The block
+     * no longer counts towards the capacity of the cache, and must be passed
+     * to compressed_block_free.
+     * 
+     * @param cache a pointer to the cache to search.
+     * @param id the identifier of the block.
+     * @return a pointer to the block; NULL if it is not in the cache.
+     */
+    compressed_block_t *compressed_cache_take(compressed_cache_t *const cache, const ulong id);
+    /**
+     * Decompress a block removed from a cache.
+     * 
+     * @param block a pointer to the block.
+     * @param dest a pointer to the memory to receive the content.
+     * @param capacity the number of bytes available at dest, which must be at
+     *                 least the length of the block when it was added.
+     * @return the length of the block on success; -1 if it could not be
+     *         decompressed.
+     */
+    long compressed_block_decode(const compressed_block_t *const block, char *const dest,
+                                 const ulong capacity);
+    /**
+     * Deallocate a block removed from a cache.
+     * 
+     * @param block a pointer to the block to deallocate.
+     */
+    void compressed_block_free(compressed_block_t *const block);
+
+    /**
+     * Return the number of bytes of compressed data held by a cache.
+     * 
+     * @param cache a pointer to the cache to query.
+     */
+    ulong compressed_cache_size(const compressed_cache_t *const cache);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* COMPRESSED_CACHE_H */
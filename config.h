@@ -16,6 +16,8 @@
 #define XD3_USE_LARGEFILE64 1
 // Enable DJW compressor
 #define SECONDARY_DJW 1
+// Enable FGK compressor
+#define SECONDARY_FGK 1
 // Disable the configurable compression algorithm; presets will suffice.
 #define XD3_BUILD_SOFT 0
 // The library attempts an optimisation during matching by using unaligned, unsigned
@@ -27,6 +29,27 @@
 #else
 #   define UNALIGNED_OK 0
 #endif
+// Match extension compares 16 or 32 bytes at a time with SSE2 or AVX2, chosen
+// according to the processor by match_kernel_init when the module is imported.
+// This needs the target attribute and processor detection of GCC and Clang.
+#if (defined(__i386) || defined(__x86_64__)) && defined(__GNUC__)
+#   define SIMD_MATCH 1
+#else
+#   define SIMD_MATCH 0
+#endif
+
+// POSIX threads are used for native source reading and batch processing where
+// they are available.
+#if defined(_WIN32)
+#   define HAVE_PTHREAD 0
+#else
+#   define HAVE_PTHREAD 1
+#endif
+// Source files are read natively, using pread and a readahead thread.
+#define NATIVE_SOURCE_READER HAVE_PTHREAD
+// Streams share source blocks through a process-wide cache, which requires
+// locking.
+#define SHARED_SOURCE_CACHE HAVE_PTHREAD
 
 // The size of `size_t', as computed by sizeof.
 #define SIZEOF_SIZE_T 8
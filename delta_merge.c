@@ -0,0 +1,311 @@
+#include "delta_merge.h"
+#include <errno.h>
+#include <string.h>
+
+/* The window indicator bit, private to xdelta3.c, for a window checksum. */
+#define VCD_ADLER32 0x04
+
+typedef struct {
+    uint8_t *data;
+    usize_t size;
+    usize_t capacity;
+} output_t;
+
+static int read_whole(xd3_stream *const stream, const uint8_t *const delta,
+                      const usize_t length);
+static void drop_empty(xd3_whole_state *const whole);
+static int write_whole(xd3_whole_state *const whole, const xd3_config *const config,
+                       const int checksums, output_t *const output, const char **const message);
+static int append_output(output_t *const output, const uint8_t *const data,
+                         const usize_t length);
+
+
+int delta_merge(const uint8_t *const *deltas, const usize_t *lengths, const ulong count,
+        const xd3_config *const config, uint8_t **const output, usize_t *const output_size,
+        const char **const message) {
+    xd3_stream merged;
+    xd3_stream input;
+    xd3_config input_config;
+    output_t result = {NULL, 0, 0};
+    int checksums = 0;
+    ulong i;
+    int ret;
+
+    *message = "";
+    memset(&input, 0, sizeof(input));
+    if ((ret = xd3_config_stream(&merged, NULL)) != 0
+            || (ret = xd3_merge_whole_init(&merged)) != 0)
+        goto exit;
+
+    for (i = 0; i < count; i++) {
+        // Only the instructions are wanted, so nothing is decoded and no
+        // source is needed.
+        xd3_init_config(&input_config, XD3_SKIP_EMIT | XD3_ADLER32_NOVER);
+        if ((ret = xd3_config_stream(&input, &input_config)) != 0
+                || (ret = xd3_merge_whole_init(&input)) != 0
+                || (ret = read_whole(&input, deltas[i], lengths[i])) != 0
+                || ((i > 0) && (ret = xd3_merge_input_output(&input, &merged.whole_target)) != 0)) {
+            *message = xd3_errstring(&input);
+            goto exit;
+        }
+        drop_empty(&input.whole_target);
+        checksums = (input.dec_win_ind & VCD_ADLER32) != 0;
+        // The result so far is the source of the next delta.
+        xd3_merge_whole_swap(&merged.whole_target, &input.whole_target);
+        xd3_free_stream(&input);
+    }
+
+    if ((ret = write_whole(&merged.whole_target, config, checksums, &result, message)) == 0) {
+        *output = result.data;
+        *output_size = result.size;
+        result.data = NULL;
+    }
+
+exit:
+    free(result.data);
+    xd3_free_stream(&input);
+    xd3_free_stream(&merged);
+    return ret;
+}
+
+
+/**
+ * Decode the instructions of every window of a delta into the whole state of
+ * a stream.
+ * 
+ * @param stream a pointer to a decoder configured with XD3_SKIP_EMIT.
+ * @param delta a pointer to the delta.
+ * @param length the length of the delta.
+ * @return zero (0) on success; an error code from the engine otherwise.
+ */
+static int read_whole(xd3_stream *const stream, const uint8_t *const delta,
+        const usize_t length) {
+    int ret;
+
+    // The engine uses a NULL input pointer to detect that no input has ever
+    // been provided.
+    xd3_avail_input(stream, (delta != NULL) ? delta : (const uint8_t *) "", length);
+    for (;;) {
+        switch (ret = xd3_decode_input(stream)) {
+            case XD3_INPUT:
+                if (stream->dec_state != DEC_WININD) {
+                    stream->msg = "truncated delta";
+                    return XD3_INVALID_INPUT;
+                }
+                return 0;
+            case XD3_OUTPUT:
+                if ((ret = xd3_whole_append_window(stream)) != 0)
+                    return ret;
+                xd3_consume_output(stream);
+                continue;
+            case XD3_GOTHEADER:
+                /* Fall through */
+            case XD3_WINSTART:
+                /* Fall through */
+            case XD3_WINFINISH:
+                continue;
+            default:
+                return ret;
+        }
+    }
+}
+
+
+/**
+ * Remove instructions that produce nothing from a whole state, such as the
+ * runs that make up an embedded index. They would otherwise stall the search
+ * for the instructions that supply each copy.
+ * 
+ * @param whole a pointer to the state to compact.
+ */
+static void drop_empty(xd3_whole_state *const whole) {
+    usize_t kept = 0;
+    usize_t i;
+
+    for (i = 0; i < whole->instlen; i++)
+        if (whole->inst[i].size > 0)
+            whole->inst[kept++] = whole->inst[i];
+    whole->instlen = kept;
+}
+
+
+/**
+ * Encode the whole state of a stream as a delta.
+ * 
+ * Each window of the state is encoded as a window of the output by passing
+ * its instructions straight to the encoder, bypassing the search for matches.
+ * Data added by the instructions forms the input of the window.
+ * 
+ * @param whole a pointer to the state to encode, which is modified.
+ * @param config a pointer to the configuration of the encoder.
+ * @param checksums true if the windows of the state carry checksums.
+ * @param output a pointer to the output to append the delta to.
+ * @param message a pointer to the location to store a description of any
+ *                error.
+ * @return zero (0) on success; an error code from the engine otherwise.
+ */
+static int write_whole(xd3_whole_state *const whole, const xd3_config *const config,
+        const int checksums, output_t *const output, const char **const message) {
+    xd3_stream stream;
+    xd3_config recode_config = *config;
+    xd3_source source;
+    uint8_t *buffer;
+    usize_t capacity = 1;
+    usize_t inst_pos = 0;
+    xoff_t output_pos = 0;
+    usize_t window_num = 0;
+    int ret;
+
+    for (window_num = 0; window_num < whole->wininfolen; window_num++)
+        capacity = xd3_max(capacity, whole->wininfo[window_num].length);
+    window_num = 0;
+    if ((buffer = (uint8_t *) malloc(capacity)) == NULL)
+        return ENOMEM;
+    memset(&source, 0, sizeof(source));
+    // Checksums cannot be calculated from the input, which holds only the
+    // added data, so those of the last delta are carried over.
+    recode_config.flags &= ~XD3_ADLER32;
+    if ((ret = xd3_config_stream(&stream, &recode_config)) != 0
+            || (ret = xd3_encode_init_partial(&stream)) != 0)
+        goto exit;
+
+    // Enter the input state directly, bypassing the buffering of input.
+    stream.enc_state = ENC_INPUT;
+    stream.next_in = buffer;
+    stream.flags |= XD3_FLUSH;
+
+    // At least one window is encoded, so that an empty target still
+    // produces a valid delta.
+    do {
+        const xoff_t window_start = output_pos;
+        int window_srcset = 0;
+        xoff_t window_srcmin = 0;
+        xoff_t window_srcmax = 0;
+        usize_t window_pos = 0;
+        usize_t window_size;
+
+        if ((ret = xd3_encode_input(&stream)) != XD3_WINSTART) {
+            stream.msg = "invalid merge state";
+            ret = XD3_INTERNAL;
+            goto exit;
+        }
+        // Windows match those of the input so that target copies remain in
+        // range and checksums remain valid.
+        if ((window_num >= whole->wininfolen)
+                || (output_pos != whole->wininfo[window_num].offset)) {
+            stream.msg = "window mismatch in merge";
+            ret = XD3_INVALID_INPUT;
+            goto exit;
+        }
+        window_size = whole->wininfo[window_num].length;
+        if (checksums) {
+            stream.flags |= XD3_ADLER32_RECODE;
+            stream.recode_adler32 = whole->wininfo[window_num].adler32;
+        }
+        window_num++;
+
+        while ((window_pos < window_size) && (inst_pos < whole->instlen)) {
+            xd3_winst *const inst = &whole->inst[inst_pos];
+            const usize_t take = xd3_min(inst->size, window_size - window_pos);
+
+            switch (inst->type) {
+                case XD3_RUN:
+                    if ((ret = xd3_merge_emit_run(&stream, window_pos, take,
+                            &whole->adds[inst->addr])) != 0)
+                        goto exit;
+                    break;
+                case XD3_ADD:
+                    // Added data is implicit; it is whatever the input holds
+                    // between the other instructions.
+                    memcpy(buffer + window_pos, whole->adds + inst->addr, take);
+                    break;
+                default: {
+                    xoff_t addr = inst->addr;
+                    if (inst->mode != 0) {
+                        if (window_srcset) {
+                            window_srcmin = xd3_min(window_srcmin, inst->addr);
+                            window_srcmax = xd3_max(window_srcmax, inst->addr + take);
+                        } else {
+                            window_srcset = 1;
+                            window_srcmin = inst->addr;
+                            window_srcmax = inst->addr + take;
+                        }
+                    } else
+                        addr -= window_start;
+                    if ((ret = xd3_found_match(&stream, window_pos, take, addr,
+                            inst->mode != 0)) != 0)
+                        goto exit;
+                    break;
+                }
+            }
+
+            window_pos += take;
+            output_pos += take;
+            if (take == inst->size)
+                inst_pos++;
+            else {
+                // The rest of the instruction starts the next window.
+                if (inst->type != XD3_RUN)
+                    inst->addr += take;
+                inst->size -= take;
+            }
+        }
+
+        xd3_avail_input(&stream, buffer, window_pos);
+        stream.enc_state = ENC_INSTR;
+        if (window_srcset) {
+            stream.srcwin_decided = 1;
+            stream.src = &source;
+            source.srclen = (usize_t) (window_srcmax - window_srcmin);
+            source.srcbase = window_srcmin;
+            stream.taroff = source.srclen;
+        } else {
+            stream.srcwin_decided = 0;
+            stream.src = NULL;
+            stream.taroff = 0;
+        }
+
+        for (;;) {
+            ret = xd3_encode_input(&stream);
+            if (ret == XD3_INPUT)
+                break;
+            if (ret == XD3_OUTPUT) {
+                if ((ret = append_output(output, stream.next_out, stream.avail_out)) != 0)
+                    goto exit;
+                xd3_consume_output(&stream);
+            } else if ((ret != XD3_GOTHEADER) && (ret != XD3_WINSTART)
+                    && (ret != XD3_WINFINISH)) {
+                if ((ret == XD3_GETSRCBLK) || (ret == 0))
+                    ret = XD3_INTERNAL;
+                goto exit;
+            }
+        }
+    } while (inst_pos < whole->instlen);
+    ret = 0;
+
+exit:
+    if (ret != 0)
+        *message = xd3_errstring(&stream);
+    stream.src = NULL;
+    xd3_free_stream(&stream);
+    free(buffer);
+    return ret;
+}
+
+
+static int append_output(output_t *const output, const uint8_t *const data,
+        const usize_t length) {
+    if (output->size + length > output->capacity) {
+        usize_t capacity = xd3_max(output->capacity * 2, XD3_ALLOCSIZE);
+        uint8_t *grown;
+        while (capacity < output->size + length)
+            capacity *= 2;
+        if ((grown = (uint8_t *) realloc(output->data, capacity)) == NULL)
+            return ENOMEM;
+        output->data = grown;
+        output->capacity = capacity;
+    }
+    memcpy(output->data + output->size, data, length);
+    output->size += length;
+    return 0;
+}
@@ -0,0 +1,69 @@
+/* 
+ * File:   delta_merge.h
+ * Author: Michael Winter <mail@michael-winter.me.uk>
+ *
+ * Created on 16 October 2026, 18:20
+ */
+
+#ifndef DELTA_MERGE_H
+#define	DELTA_MERGE_H
+
+#include "config.h"
+
+#include "xdelta3.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+    typedef unsigned long ulong;
+
+    /**
+     * Combine a chain of deltas into a single delta.
+     * 
+     * Each delta must have been encoded against the target of the one before
+     * it. The result encodes the target of the last delta against the source
+     * of the first, so it is decoded in one pass rather than one per delta.
+     * No target is reconstructed: the instructions of each delta are
+     * rewritten in terms of those of its predecessor, then encoded again. The
+     * windows of the result match those of the last delta, and carry its
+     * checksums if it has them.
+     * 
+     * The function does not use the Python interpreter.
+     * 
+     * @param deltas the deltas to combine, from oldest to newest.
+     * @param lengths the length of each delta.
+     * @param count the number of deltas, which must be at least one (1).
+     * @param config a pointer to the configuration of the encoder that
+     *               produces the result. Only its secondary compression
+     *               settings are significant.
+     * @param output a pointer to the location to store a pointer to the
+     *               result, which must be released with free.
+     * @param output_size a pointer to the location to store the size of the
+     *                    result.
+     * @param message a pointer to the location to store a description of any
+     *                error, which is a static string.
+     * @return zero (0) on success; ENOMEM if memory could not be allocated;
+     *         another error code from the engine if a delta is invalid or
+     *         the deltas cannot be combined.
+     */
+    int delta_merge(const uint8_t *const *deltas, const usize_t *lengths, const ulong count,
+                    const xd3_config *const config, uint8_t **const output,
+                    usize_t *const output_size, const char **const message);
+
+    /* Defined in xdelta3.c, where they can reach the static routines that
+     * they wrap and those of xdelta3-merge.h. */
+    int  xd3_merge_whole_init(xd3_stream *stream);
+    void xd3_merge_whole_swap(xd3_whole_state *a, xd3_whole_state *b);
+    int  xd3_merge_emit_run(xd3_stream *stream, usize_t pos, usize_t size, uint8_t *run_c);
+    int  xd3_whole_append_window(xd3_stream *stream);
+    int  xd3_merge_input_output(xd3_stream *stream, xd3_whole_state *source);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* DELTA_MERGE_H */
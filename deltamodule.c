@@ -10,33 +10,134 @@
 #define MODULE_NAME "_xdelta"
 #define STREAM_NAME "Stream"
 #define QUALIFIED_NAME(NAME) MODULE_NAME "." NAME
-#define MAX_SOURCE_BLOCKS 32
-#define SOURCE_BLOCK_SIZE (XD3_DEFAULT_SRCWINSZ / MAX_SOURCE_BLOCKS)
+#define DEFAULT_LEVEL 9
+#define DEFAULT_SECONDARY "djw"
+#define DEFAULT_SOURCE_BLOCKS 32
 
 
 typedef int       (*processing_func) (xd3_stream *);
-typedef PyObject *(*input_func) (PyObject *const, const size_t, const size_t);
-typedef int       (*output_func) (PyObject **dest, const char *const src, const size_t len);
+typedef struct {
+    const char *name;
+    xd3_smatch_cfg config;
+} matcher_preset;
+
+/* An item of work for encode_many or decode_many. */
+typedef struct {
+    Py_buffer input;
+    Py_buffer source;
+    xd3_config config;
+    uint8_t *output;
+    usize_t length;
+    int ret;
+} batch_job;
+
+/* A delta file being indexed by scan_windows. */
+typedef struct {
+    PyObject *file;
+    PY_LONG_LONG origin;
+} delta_file;
+
+/* The work shared by the threads processing a batch. */
+typedef struct {
+    batch_job *jobs;
+    int encoding;
+} batch;
+typedef int       (*input_func) (void *const src, const size_t offset, const size_t max_length,
+                                 Py_buffer *view);
+typedef int       (*output_func) (void *const dest, const char *const src, const size_t len);
+
+/* A caller-owned buffer being filled by Stream.readinto. */
+typedef struct {
+    Py_buffer view;
+    Py_ssize_t position;
+} output_buffer;
 
 
 static PyObject *stream_new(PyTypeObject *, PyObject *, PyObject *);
 static int       stream_init(xd3py_stream *, PyObject *, PyObject *);
 static void      stream_dealloc(xd3py_stream *);
 static PyObject *stream_read(xd3py_stream *, PyObject *, PyObject *);
+static PyObject *stream_readinto(xd3py_stream *, PyObject *, PyObject *);
 static PyObject *stream_write(xd3py_stream *, PyObject *, PyObject *);
 static PyObject *stream_flush(xd3py_stream *const);
+static PyObject *stream_encode_step(xd3py_stream *, PyObject *, PyObject *);
+static PyObject *stream_decode_step(xd3py_stream *, PyObject *, PyObject *);
+static PyObject *stream_supply_block(xd3py_stream *, PyObject *, PyObject *);
+static PyObject *process_step(xd3py_stream *const, PyObject *, processing_func);
+static PyObject *stream_iter_windows(xd3py_stream *const);
+
+static void      window_iter_dealloc(xd3py_window_iter *);
+static PyObject *window_iter_next(xd3py_window_iter *);
+static int       window_iter_getbuffer(xd3py_window_iter *, Py_buffer *, int);
+static void      window_iter_releasebuffer(xd3py_window_iter *, Py_buffer *);
 
 static PyObject *stream_get_source(xd3py_stream *, void *);
 static int       stream_set_source(xd3py_stream *, PyObject *, void *);
+static PyObject *stream_get_stats(xd3py_stream *, void *);
+static PyObject *stream_get_block_size(xd3py_stream *, void *);
+
+static PyObject *module_encode(PyObject *, PyObject *, PyObject *);
+static PyObject *module_decode(PyObject *, PyObject *, PyObject *);
+static PyObject *module_encode_many(PyObject *, PyObject *, PyObject *);
+static PyObject *module_decode_many(PyObject *, PyObject *, PyObject *);
+static PyObject *process_batch(PyObject *, const Py_ssize_t, const xd3_config *const);
+static void      run_batch_job(void *, const ulong);
+static PyObject *module_merge(PyObject *, PyObject *, PyObject *);
+static PyObject *module_scan_windows(PyObject *, PyObject *, PyObject *);
+static PyObject *module_set_cache_budget(PyObject *, PyObject *, PyObject *);
+static PyObject *module_set_shared_cache_capacity(PyObject *, PyObject *, PyObject *);
+static PyObject *module_cache_usage(PyObject *);
+static long      read_delta(void *, const xoff_t, uint8_t *, const usize_t);
+static int       encode_memory(const Py_buffer *const, const Py_buffer *const, xd3_config *const,
+                               uint8_t *const, usize_t *const, const usize_t);
+static void      fit_window(xd3_config *const, const Py_ssize_t);
+static usize_t   encode_capacity(const Py_ssize_t);
+static usize_t   decode_capacity(const Py_ssize_t, const Py_ssize_t);
 
 static PyObject *read_from_file(PyObject *const, const size_t, const size_t);
-static PyObject *read_from_string(PyObject *const, const size_t, const size_t);
-static int       write_to_file(PyObject **, const char *const, const size_t);
-static int       write_to_string(PyObject **, const char *const, const size_t);
-
+static int       input_from_file(void *const, const size_t, const size_t, Py_buffer *);
+static int       input_from_buffer(void *const, const size_t, const size_t, Py_buffer *);
+static int       input_from_pending(void *const, const size_t, const size_t, Py_buffer *);
+static int       write_to_file(void *const, const char *const, const size_t);
+static int       write_to_string(void *const, const char *const, const size_t);
+static int       write_to_buffer(void *const, const char *const, const size_t);
+static int       write_to_view(void *const, const char *const, const size_t);
+
+static int replace_source(xd3py_stream *const, PyObject *);
 static int get_source_block(xd3_stream *, xd3_source *, xoff_t);
-static int do_processing(xd3_stream *const, PyObject *const, PyObject **, const Py_ssize_t,
-                         input_func, processing_func, output_func, buffer_t **);
+static const lru_cache_entry_t *cache_get(xd3py_stream *const, const ulong);
+static lru_cache_entry_t *cache_claim(xd3py_stream *const, const ulong);
+static const lru_cache_entry_t *cache_publish(xd3py_stream *const, lru_cache_entry_t *const);
+static void cache_abandon(xd3py_stream *const, lru_cache_entry_t *const);
+static const lru_cache_entry_t *cache_put(xd3py_stream *const, const ulong, const char *const,
+                                          const ulong);
+static void cache_release(xd3py_stream *const, const lru_cache_entry_t *const);
+static void cache_hold(xd3py_stream *const, const lru_cache_entry_t *const);
+static void close_shared_source(xd3py_stream *const);
+static int restore_block(xd3py_stream *const, const ulong, const lru_cache_entry_t **const);
+static void stash_block(void *const, const lru_cache_entry_t *const);
+static PY_LONG_LONG get_source_origin(PyObject *);
+static PY_LONG_LONG get_source_size(PyObject *, const PY_LONG_LONG);
+static int native_file_descriptor(PyObject *, const PY_LONG_LONG);
+static source_reader_t *open_source_reader(PyObject *, const PY_LONG_LONG, const ulong);
+
+static int configure_stream(xd3_config *const, const int, const char *, const char *,
+                            const Py_ssize_t);
+static ulong round_up_pow2(ulong);
+static ulong choose_block_size(const xd3py_stream *const, const PY_LONG_LONG);
+static int record_window(xd3py_stream *const);
+static int write_index(xd3py_stream *const, output_func, void *const);
+static xoff_t indexed_header_size(const xd3_stream *const);
+static int do_processing(xd3py_stream *const, void *const, void *const, const Py_ssize_t,
+                         input_func, processing_func, output_func);
+
+static int get_content_buffer(PyObject *, Py_buffer *);
+static int get_writable_buffer(PyObject *, Py_buffer *);
+static int  run_engine(xd3_stream *const, processing_func);
+static double monotonic_time(void);
+static int  acquire_gil(xd3py_stream *const);
+static void release_gil(xd3py_stream *const);
+static int  enter_stream(xd3py_stream *const);
 
 static int file_object_check(PyObject *);
 static int in_progress(const xd3_stream *const);
@@ -46,6 +147,12 @@ static int is_callable(PyObject *, const char *);
 static PyGetSetDef stream_accessors[] = {
     {"source", (getter) stream_get_source, (setter) stream_set_source,
             "Specify the source file used for comparison during encoding and decoding.", NULL},
+    {"stats", (getter) stream_get_stats, NULL,
+            "Performance counters for the stream: engine and I/O times, cache use, bytes "
+            "processed and windows completed.", NULL},
+    {"block_size", (getter) stream_get_block_size, NULL,
+            "The size of each source block, as requested by encode_step and decode_step.",
+            NULL},
     {NULL}  /* sentinel */
 };
 
@@ -53,10 +160,23 @@ static PyGetSetDef stream_accessors[] = {
 static PyMethodDef stream_methods[] = {
     {"read", (PyCFunction) stream_read, METH_VARARGS | METH_KEYWORDS,
             "Read and decode a number of bytes from the stream."},
+    {"readinto", (PyCFunction) stream_readinto, METH_VARARGS | METH_KEYWORDS,
+            "Read and decode bytes from the stream into a writable buffer."},
     {"write", (PyCFunction) stream_write, METH_VARARGS | METH_KEYWORDS,
             "Write and encode the specified data to the stream."},
     {"flush", (PyCFunction) stream_flush, METH_NOARGS,
             "Write any buffered data to the stream."},
+    {"encode_step", (PyCFunction) stream_encode_step, METH_VARARGS | METH_KEYWORDS,
+            "Encode data without blocking, returning the output and any source block "
+            "needed to continue."},
+    {"decode_step", (PyCFunction) stream_decode_step, METH_VARARGS | METH_KEYWORDS,
+            "Decode data without blocking, returning the output and any source block "
+            "needed to continue."},
+    {"iter_windows", (PyCFunction) stream_iter_windows, METH_NOARGS,
+            "Iterate over the decoded output of each window as a memoryview that is valid until "
+            "the next is produced."},
+    {"supply_block", (PyCFunction) stream_supply_block, METH_VARARGS | METH_KEYWORDS,
+            "Provide a block of source data requested by encode_step or decode_step."},
     {NULL}  /* sentinel */
 };
 
@@ -104,7 +224,83 @@ static PyTypeObject stream_type = {
 };
 
 
+static PyBufferProcs window_iter_buffer = {
+    0,                                         /*bf_getreadbuffer*/
+    0,                                         /*bf_getwritebuffer*/
+    0,                                         /*bf_getsegcount*/
+    0,                                         /*bf_getcharbuffer*/
+    (getbufferproc) window_iter_getbuffer,     /*bf_getbuffer*/
+    (releasebufferproc) window_iter_releasebuffer, /*bf_releasebuffer*/
+};
+
+
+static PyTypeObject window_iter_type = {
+    PyObject_HEAD_INIT(NULL)
+    0,                                /*ob_size*/
+    QUALIFIED_NAME("WindowIterator"), /*tp_name*/
+    sizeof(xd3py_window_iter),        /*tp_basicsize*/
+    0,                                /*tp_itemsize*/
+    (destructor) window_iter_dealloc, /*tp_dealloc*/
+    0,                                /*tp_print*/
+    0,                                /*tp_getattr*/
+    0,                                /*tp_setattr*/
+    0,                                /*tp_compare*/
+    0,                                /*tp_repr*/
+    0,                                /*tp_as_number*/
+    0,                                /*tp_as_sequence*/
+    0,                                /*tp_as_mapping*/
+    0,                                /*tp_hash*/
+    0,                                /*tp_call*/
+    0,                                /*tp_str*/
+    0,                                /*tp_getattro*/
+    0,                                /*tp_setattro*/
+    &window_iter_buffer,              /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /*tp_flags*/
+    "Iterator over the decoded windows of a Stream", /*tp_doc*/
+    0,                                /*tp_traverse*/
+    0,                                /*tp_clear*/
+    0,                                /*tp_richcompare*/
+    0,                                /*tp_weaklistoffset*/
+    PyObject_SelfIter,                /*tp_iter*/
+    (iternextfunc) window_iter_next,  /*tp_iternext*/
+};
+
+
+/* The string matcher presets defined in xdelta3-cfgs.h, by name. */
+static const matcher_preset matcher_presets[] = {
+    {"fastest", XD3_SMATCH_FASTEST},
+    {"faster",  XD3_SMATCH_FASTER},
+    {"fast",    XD3_SMATCH_FAST},
+    {"default", XD3_SMATCH_DEFAULT},
+    {"slow",    XD3_SMATCH_SLOW},
+    {NULL}  /* sentinel */
+};
+
+
+/* The types of file object whose file descriptors can be read natively. */
+static PyObject *native_file_types = NULL;
+
+
 static PyMethodDef module_functions[] = {
+    {"encode", (PyCFunction) module_encode, METH_VARARGS | METH_KEYWORDS,
+            "Encode data held in memory, optionally against an in-memory source."},
+    {"decode", (PyCFunction) module_decode, METH_VARARGS | METH_KEYWORDS,
+            "Decode a delta held in memory, optionally against an in-memory source."},
+    {"encode_many", (PyCFunction) module_encode_many, METH_VARARGS | METH_KEYWORDS,
+            "Encode a sequence of (target, source) pairs in parallel."},
+    {"decode_many", (PyCFunction) module_decode_many, METH_VARARGS | METH_KEYWORDS,
+            "Decode a sequence of (delta, source) pairs in parallel."},
+    {"merge", (PyCFunction) module_merge, METH_VARARGS | METH_KEYWORDS,
+            "Combine a chain of deltas into one delta against the oldest source."},
+    {"scan_windows", (PyCFunction) module_scan_windows, METH_VARARGS | METH_KEYWORDS,
+            "Index the windows of a seekable delta file from its embedded index or headers."},
+    {"set_cache_budget", (PyCFunction) module_set_cache_budget, METH_VARARGS | METH_KEYWORDS,
+            "Limit the memory used by the source caches of all streams; 0 for no limit."},
+    {"set_shared_cache_capacity", (PyCFunction) module_set_shared_cache_capacity,
+            METH_VARARGS | METH_KEYWORDS,
+            "Set how much source data the cache shared by streams may retain."},
+    {"cache_usage", (PyCFunction) module_cache_usage, METH_NOARGS,
+            "Report the memory allocated by source caches and the budget that limits it."},
     {NULL}  /* sentinel */
 };
 
@@ -137,30 +333,107 @@ static PyObject *stream_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
  * Takes ownership of objects passed as the target and source arguments (or
  * None if they were omitted).
  * 
+ * The remaining arguments tune the encoder and are optional:
+ * 
+ *   level          - the compression level, from 0 (none) to 9 (best).
+ *   matcher        - the string matcher preset: "fastest", "faster", "fast",
+ *                    "default" or "slow". If omitted, it is chosen to suit the
+ *                    level.
+ *   secondary      - the secondary compressor: "none", "djw" or "fgk".
+ *   winsize        - the size of each encoded window of target data.
+ *   source_winsize - how much of the source is considered for matches, which
+ *                    is also the most the source block cache will hold.
+ *   cache_blocks   - the number of blocks the source cache is divided into.
+ *                    The block size is source_winsize / cache_blocks rounded
+ *                    up to a power of two, or less if the source is known to
+ *                    be smaller than source_winsize. Blocks are allocated as
+ *                    they are first used, within the budget shared by all
+ *                    streams; see set_cache_budget.
+ *   cache_policy   - the retention policy of the source cache: "lru" to
+ *                    replace the least recently used block, or "2q", which
+ *                    keeps frequently used blocks through a sequential pass
+ *                    over the source. Not allowed with source_key.
+ *   compressed_cache - the number of bytes of memory in which blocks evicted
+ *                    from the source cache are kept compressed, so that they
+ *                    need not be fetched again; zero (0), the default,
+ *                    disables this. Not allowed with source_key.
+ *   index          - if true, an index of the encoded windows is embedded in
+ *                    the output each time the stream is flushed, so that
+ *                    readers can locate any window without scanning. Each
+ *                    index lists every window so far and earlier ones are
+ *                    left in place, so this suits streams flushed once, at
+ *                    the end; flushing N times stores O(N^2) index entries.
+ *   source_key     - a string identifying the content of the source from its
+ *                    current position. Streams with the same key, and the
+ *                    same block size, share source blocks through a
+ *                    process-wide cache, which always replaces the least
+ *                    recently used block. Blocks outlive the streams that
+ *                    read them, so the key must change whenever the content
+ *                    does. Without a key, each stream has its own cache.
+ * 
  * @param self a pointer to an allocated stream instance.
  * @param args a pointer to a tuple containing the position arguments "target"
  *             and "source" passed during invocation. Both are file-like
  *             objects (they have, at a minimum, read and write methods) and
  *             are optional.
  * @param kwds a pointer to a dictionary optionally containing the named
- *             arguments "target" and "source" passed during invocation.
+ *             arguments "target", "source" and the tuning arguments above.
  * @return 0 on success; -1 otherwise.
  */
 static int stream_init(xd3py_stream *self, PyObject *args, PyObject *kwds) {
     PyObject *target = NULL;
     PyObject *source = NULL;
-    static char *kwlist[] = {"target", "source", NULL};
+    int level = DEFAULT_LEVEL;
+    const char *matcher = NULL;
+    const char *secondary = DEFAULT_SECONDARY;
+    Py_ssize_t winsize = XD3_DEFAULT_WINSIZE;
+    Py_ssize_t source_winsize = XD3_DEFAULT_SRCWINSZ;
+    Py_ssize_t cache_blocks = DEFAULT_SOURCE_BLOCKS;
+    Py_ssize_t compressed_cache = 0;
+    PyObject *index = NULL;
+    const char *source_key = NULL;
+    const char *cache_policy = "lru";
+    static char *kwlist[] = {"target", "source", "level", "matcher", "secondary", "winsize",
+            "source_winsize", "cache_blocks", "index", "source_key", "cache_policy",
+            "compressed_cache", NULL};
     xd3_config config;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OO", kwlist, &target, &source))
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OOizznnnOzsn", kwlist, &target, &source,
+            &level, &matcher, &secondary, &winsize, &source_winsize, &cache_blocks, &index,
+            &source_key, &cache_policy, &compressed_cache))
+        return -1;
+    if ((index != NULL) && ((self->indexed = PyObject_IsTrue(index)) == -1))
+        return -1;
+    if (!configure_stream(&config, level, matcher, secondary, winsize))
+        return -1;
+    if ((cache_blocks < 1) || (source_winsize < cache_blocks)) {
+        PyErr_SetString(PyExc_ValueError,
+                "cache_blocks must be positive and no greater than source_winsize");
+        return -1;
+    }
+    if (strcmp(cache_policy, "lru") == 0)
+        self->cache_policy = LRU_CACHE_LRU;
+    else if (strcmp(cache_policy, "2q") == 0)
+        self->cache_policy = LRU_CACHE_2Q;
+    else {
+        PyErr_Format(PyExc_ValueError, "unknown cache policy: %s", cache_policy);
+        return -1;
+    }
+    if (compressed_cache < 0) {
+        PyErr_SetString(PyExc_ValueError, "compressed_cache must not be negative");
+        return -1;
+    }
+    if ((source_key != NULL) && ((self->cache_policy != LRU_CACHE_LRU) || (compressed_cache > 0))) {
+        PyErr_SetString(PyExc_ValueError,
+                "cache_policy and compressed_cache cannot be used with source_key");
+        return -1;
+    }
+    self->compressed_capacity = (ulong) compressed_cache;
+    self->cache_blocks = (ulong) cache_blocks;
+    self->source_winsize = (ulong) source_winsize;
+    self->block_size = choose_block_size(self, 0);
+    if ((source_key != NULL) && ((self->source_key = PyString_FromString(source_key)) == NULL))
         return -1;
-
-    xd3_init_config(&config, XD3_SEC_DJW | XD3_ADLER32 | XD3_COMPLEVEL_9);
-    config.sec_data.ngroups = 0;
-    config.sec_inst.ngroups = 1;
-    config.sec_addr.ngroups = 1;
-    config.smatch_cfg = XD3_SMATCH_SLOW;
-    config.iopt_size = XD3_DEFAULT_IOPT_SIZE;
     config.getblk = get_source_block;
     config.opaque = self;
 
@@ -174,10 +447,16 @@ static int stream_init(xd3py_stream *self, PyObject *args, PyObject *kwds) {
         Py_XDECREF(temp);
     }
 
-    if (xd3_config_stream(&self->stream, &config) != 0)
+    if (xd3_config_stream(&self->stream, &config) != 0) {
+        PyErr_SetString(PyExc_ValueError, xd3_errstring(&self->stream));
         return -1;
+    }
+    if (self->indexed) {
+        window_index_appheader(self->appheader, 0);
+        xd3_set_appheader(&self->stream, self->appheader, WINDOW_INDEX_APPHEADER_SIZE);
+    }
+    self->target_origin = -1;
 
-    self->cache = lru_cache_init(MAX_SOURCE_BLOCKS, SOURCE_BLOCK_SIZE);
     if (source && (stream_set_source(self, source, NULL) == -1))
         return -1;
 
@@ -201,8 +480,16 @@ static void stream_dealloc(xd3py_stream *self) {
         free(self->source);
         self->source = NULL;
     }
+    source_reader_free(self->reader);
     lru_cache_free(self->cache);
-    buffer_release(&self->buffer);
+    compressed_cache_free(self->compressed);
+    close_shared_source(self);
+    Py_XDECREF(self->source_key);
+    if (self->input_held)
+        PyBuffer_Release(&self->input);
+    if (self->pending_held)
+        PyBuffer_Release(&self->pending);
+    window_index_free(&self->windows);
     xd3_free_stream(&self->stream);
 
     self->ob_type->tp_free((PyObject *) self);
@@ -215,6 +502,10 @@ static void stream_dealloc(xd3py_stream *self) {
  * 
  * Ownership of the returned string is passed to the caller.
  * 
+ * Decoding stops as soon as num_bytes have been produced. Any remaining output
+ * of the current window is left with the engine and returned by the next
+ * read, so no more input is consumed than is needed to satisfy the request.
+ * 
  * @param self a pointer to the stream instance from which data is read.
  * @param args a pointer to a tuple that may contain the positional argument
  *             num_bytes, which is an upper limit on the number of bytes
@@ -227,23 +518,66 @@ static void stream_dealloc(xd3py_stream *self) {
  */
 static PyObject *stream_read(xd3py_stream *self, PyObject *args, PyObject *kwds) {
     static char *kwlist[] = {"num_bytes", NULL};
-    Py_ssize_t allocated = buffer_remaining(self->buffer);
     PyObject *result = NULL;
     Py_ssize_t wanted = -1;
-    ulong consumed;
 
     if (!PyArg_ParseTupleAndKeywords(args, kwds, "|n", kwlist, &wanted))
         return NULL;
-    if ((wanted != -1) && (wanted < allocated))
-        allocated = wanted;
-    if (!(result = PyString_FromStringAndSize(NULL, allocated)))
+    if (!enter_stream(self))
         return NULL;
-    consumed = buffer_take(self->buffer, PyString_AS_STRING(result), (ulong) allocated);
+    if (!(result = PyString_FromStringAndSize(NULL, 0)))
+        goto exit;
     
-    if (!do_processing(&self->stream, self->target, &result, wanted - consumed, read_from_file,
-            xd3_decode_input, write_to_string, &self->buffer))
+    if (!do_processing(self, self->target, &result, wanted, input_from_file, xd3_decode_input,
+            write_to_string))
         Py_CLEAR(result);
     
+exit:
+    self->busy = 0;
+    return result;
+}
+
+
+/**
+ * Read and decode compressed data from the target file directly into a
+ * caller-owned buffer. If a source file has been provided, it will be used as
+ * a reference.
+ * 
+ * The buffer object is borrowed. Ownership of the returned integer is passed
+ * to the caller.
+ * 
+ * @param self a pointer to the stream instance from which data is read.
+ * @param args a pointer to a tuple that may contain the positional argument
+ *             buffer, which is a writable object supporting the buffer
+ *             protocol, such as a bytearray or mmap. At most len(buffer)
+ *             bytes are decoded into it.
+ * @param kwds a pointer to a dictionary that may contain the keyword argument
+ *             buffer.
+ * @return a pointer to a PyInt containing the number of bytes stored on
+ *         success; NULL otherwise.
+ */
+static PyObject *stream_readinto(xd3py_stream *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"buffer", NULL};
+    PyObject *object;
+    PyObject *result = NULL;
+    output_buffer output;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &object))
+        return NULL;
+    if (!get_writable_buffer(object, &output.view))
+        return NULL;
+    if (!enter_stream(self)) {
+        PyBuffer_Release(&output.view);
+        return NULL;
+    }
+    output.position = 0;
+    
+    if (do_processing(self, self->target, &output, output.view.len, input_from_file,
+            xd3_decode_input, write_to_buffer))
+        result = PyInt_FromSsize_t(output.position);
+    
+    self->busy = 0;
+    PyBuffer_Release(&output.view);
     return result;
 }
 
@@ -256,9 +590,10 @@ static PyObject *stream_read(xd3py_stream *self, PyObject *args, PyObject *kwds)
  * 
  * @param self a pointer to the stream instance to which data is written.
  * @param args a pointer to a tuple that may contain the positional argument
- *             content, which is a string of data to encode. If the object is
- *             not a string, it is coerced; None is equivalent to the empty
- *             string.
+ *             content, which is the data to encode. Objects supporting the
+ *             buffer protocol, such as strings, bytearrays, memoryviews and
+ *             mmaps, are encoded in place without copying. Other objects are
+ *             coerced to a string; None is equivalent to the empty string.
  * @param kwds a pointer to a dictionary that may contain the keyword argument
  *             content.
  * @return a pointer to None on success; NULL otherwise.
@@ -267,22 +602,29 @@ static PyObject *stream_write(xd3py_stream *self, PyObject *args, PyObject *kwds
     static char *kwlist[] = {"content", NULL};
     PyObject *object = NULL;
     PyObject *ret = NULL;
-    PyObject *string = NULL;
+    Py_buffer content;
 
     if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &object))
         return NULL;
-    string = (object != Py_None) ? PyObject_Str(object) : PyString_FromString("");
-    if (string == NULL)
+    if (!enter_stream(self))
+        return NULL;
+    if (!get_content_buffer(object, &content))
         goto exit;
-
-    if (do_processing(&self->stream, string, &self->target, -1, read_from_string, xd3_encode_input,
-            write_to_file, NULL)) {
+    // The index is located by rewriting the header, which requires knowing
+    // where it was written.
+    if (self->indexed && (self->stream.enc_state == ENC_INIT)
+            && (self->stream.current_window == 0))
+        self->target_origin = get_source_origin(self->target);
+
+    if (do_processing(self, &content, &self->target, -1, input_from_buffer, xd3_encode_input,
+            write_to_file)) {
         Py_INCREF(Py_None);
         ret = Py_None;
     }
+    PyBuffer_Release(&content);
     
 exit:
-    Py_XDECREF(string);
+    self->busy = 0;
     return ret;
 }
 
@@ -298,12 +640,288 @@ static PyObject *stream_flush(xd3py_stream *const self) {
         ret = stream_write(self, args, NULL);
         self->stream.flags ^= XD3_FLUSH;
         Py_DECREF(Py_None);
+        if ((ret != NULL) && self->indexed && !write_index(self, write_to_file, &self->target))
+            Py_CLEAR(ret);
         return ret;
     }
     Py_RETURN_NONE;
 }
 
 
+/**
+ * Return an iterator over the decoded output of each window read from the
+ * target file.
+ * 
+ * Each item is a read-only memoryview of the engine's output buffer, so no
+ * data is copied. The engine may replace that buffer for a later window, so
+ * every view of an item must be released before the next is requested or the
+ * stream is otherwise used, or BufferError is raised. A view keeps the stream
+ * alive. Any output left by an earlier read is produced first.
+ * 
+ * Ownership of the returned iterator is passed to the caller.
+ * 
+ * @param self a pointer to the stream instance from which data is read.
+ * @return a pointer to a new iterator on success; NULL otherwise.
+ */
+static PyObject *stream_iter_windows(xd3py_stream *const self) {
+    xd3py_window_iter *const iter = PyObject_New(xd3py_window_iter, &window_iter_type);
+    if (iter == NULL)
+        return NULL;
+    Py_INCREF(self);
+    iter->stream = self;
+    iter->data = NULL;
+    iter->length = 0;
+    return (PyObject *) iter;
+}
+
+
+static void window_iter_dealloc(xd3py_window_iter *self) {
+    Py_DECREF(self->stream);
+    PyObject_Del(self);
+}
+
+
+/**
+ * Decode the next window that produces output.
+ * 
+ * @param self a pointer to the iterator.
+ * @return a pointer to a new memoryview of the output on success; NULL, with
+ *         no exception set, at the end of the delta; NULL otherwise.
+ */
+static PyObject *window_iter_next(xd3py_window_iter *self) {
+    xd3py_stream *const stream = self->stream;
+    int ok;
+
+    if (!enter_stream(stream))
+        return NULL;
+    self->data = NULL;
+    self->length = 0;
+    ok = do_processing(stream, stream->target, self, -1, input_from_file, xd3_decode_input,
+            write_to_view);
+    stream->busy = 0;
+    if (!ok || (self->data == NULL))
+        return NULL;
+    // The view refers to the iterator, which keeps the stream and its output
+    // buffer alive.
+    return PyMemoryView_FromObject((PyObject *) self);
+}
+
+
+/**
+ * Export the output of the current window, read-only.
+ */
+static int window_iter_getbuffer(xd3py_window_iter *self, Py_buffer *view, int flags) {
+    if (PyBuffer_FillInfo(view, (PyObject *) self, (void *) self->data,
+            (Py_ssize_t) self->length, 1, flags) == -1)
+        return -1;
+    self->stream->window_exports++;
+    return 0;
+}
+
+
+static void window_iter_releasebuffer(xd3py_window_iter *self, Py_buffer *view) {
+    (void) view;
+    self->stream->window_exports--;
+}
+
+
+/**
+ * Encode data without performing any I/O, for use by event-driven callers.
+ * 
+ * The target and source objects of the stream are never touched: the encoded
+ * output is returned, and whenever the engine needs a source block that is not
+ * in the cache, encoding pauses and the block number is returned instead. The
+ * caller fetches the block however it likes, passes it to supply_block, then
+ * calls encode_step again without content to resume. A source object must
+ * still be assigned to enable encoding against a source, although it is not
+ * read.
+ * 
+ * The object passed as content is borrowed. Ownership of the returned tuple is
+ * passed to the caller.
+ * 
+ * @param self a pointer to the stream instance encoding the data.
+ * @param args a pointer to a tuple that may contain the positional arguments
+ *             content, the data to encode, which accepts the same objects as
+ *             write, and flush, which if true encodes any buffered data as
+ *             flush does.
+ * @param kwds a pointer to a dictionary that may contain the keyword arguments
+ *             content and flush.
+ * @return a pointer to a tuple containing a string of encoded output and
+ *         either the number of the source block needed to continue or None if
+ *         all of the content has been encoded, on success; NULL otherwise.
+ */
+static PyObject *stream_encode_step(xd3py_stream *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"content", "flush", NULL};
+    PyObject *content = NULL;
+    PyObject *flush = NULL;
+    int flushed;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OO", kwlist, &content, &flush))
+        return NULL;
+    if ((flush != NULL) && ((flushed = PyObject_IsTrue(flush)) == -1))
+        return NULL;
+    // As with flush, there is nothing to flush before anything is encoded.
+    if ((flush != NULL) && flushed && ((content != NULL) || in_progress(&self->stream)))
+        self->flushing = 1;
+    return process_step(self, content, xd3_encode_input);
+}
+
+
+/**
+ * Decode data without performing any I/O, for use by event-driven callers.
+ * 
+ * This is the counterpart of encode_step: the decoded output is returned, and
+ * the number of any source block needed to continue is returned for the
+ * caller to provide with supply_block before calling decode_step again without
+ * content.
+ * 
+ * The object passed as content is borrowed. Ownership of the returned tuple is
+ * passed to the caller.
+ * 
+ * @param self a pointer to the stream instance decoding the data.
+ * @param args a pointer to a tuple that may contain the positional argument
+ *             content, the next part of the delta, which accepts the same
+ *             objects as write.
+ * @param kwds a pointer to a dictionary that may contain the keyword argument
+ *             content.
+ * @return a pointer to a tuple containing a string of decoded output and
+ *         either the number of the source block needed to continue or None if
+ *         all of the content has been decoded, on success; NULL otherwise.
+ */
+static PyObject *stream_decode_step(xd3py_stream *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"content", NULL};
+    PyObject *content = NULL;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &content))
+        return NULL;
+    return process_step(self, content, xd3_decode_input);
+}
+
+
+/**
+ * Add a block of source data to the cache of a stream.
+ * 
+ * Blocks are usually supplied in response to encode_step or decode_step, but
+ * any block may be supplied in advance. Every block but the last of the
+ * source must be exactly block_size bytes long; a shorter block marks the end
+ * of the source, and a block beyond the end is empty.
+ * 
+ * The object passed as data is borrowed. Ownership of the returned None object
+ * is passed to the caller.
+ * 
+ * @param self a pointer to the stream instance to which the block is given.
+ * @param args a pointer to a tuple containing the positional arguments block,
+ *             the number of the block, and data, its content.
+ * @param kwds a pointer to a dictionary that may contain the keyword arguments
+ *             block and data.
+ * @return a pointer to None on success; NULL otherwise.
+ */
+static PyObject *stream_supply_block(xd3py_stream *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"block", "data", NULL};
+    unsigned PY_LONG_LONG block;
+    PyObject *object;
+    Py_buffer data;
+    const lru_cache_entry_t *entry;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "KO", kwlist, &block, &object))
+        return NULL;
+    if (!get_content_buffer(object, &data))
+        return NULL;
+    if ((size_t) data.len > self->block_size) {
+        PyErr_Format(PyExc_ValueError, "block must be no larger than %lu bytes",
+                self->block_size);
+        PyBuffer_Release(&data);
+        return NULL;
+    }
+    if ((self->cache == NULL) && (self->shared == NULL)) {
+        PyErr_SetString(PyExc_ValueError, "a source must be set before blocks are supplied");
+        PyBuffer_Release(&data);
+        return NULL;
+    }
+    if (!enter_stream(self)) {
+        PyBuffer_Release(&data);
+        return NULL;
+    }
+    
+    entry = cache_put(self, (ulong) block, (const char *) data.buf, (ulong) data.len);
+    if (entry == NULL) {
+        self->busy = 0;
+        PyBuffer_Release(&data);
+        return PyErr_NoMemory();
+    }
+    // The entry may have been evicted from under the engine's current block,
+    // which must then be fetched again.
+    if ((self->source != NULL) && (self->source->curblk == (const uint8_t *) entry->data))
+        self->source->curblk = NULL;
+    cache_release(self, entry);
+    self->busy = 0;
+    PyBuffer_Release(&data);
+    Py_RETURN_NONE;
+}
+
+
+/**
+ * Process the content given to encode_step or decode_step, along with any
+ * earlier content that was left when a source block was requested.
+ * 
+ * @param self a pointer to the stream instance processing the content.
+ * @param content a borrowed pointer to the content, or NULL if there is none.
+ * @param process the engine function; xd3_encode_input or xd3_decode_input.
+ * @return a pointer to a new (output, block) tuple on success; NULL otherwise.
+ */
+static PyObject *process_step(xd3py_stream *const self, PyObject *content,
+        processing_func process) {
+    PyObject *output = NULL;
+    PyObject *ret = NULL;
+    int ok;
+    
+    if ((content != NULL) && (self->pending_held || self->input_held)) {
+        PyErr_SetString(PyExc_ValueError, "the previous content has not been processed");
+        return NULL;
+    }
+    if (!enter_stream(self))
+        return NULL;
+    if (content != NULL) {
+        if (!get_content_buffer(content, &self->pending))
+            goto exit;
+        self->pending_held = 1;
+        self->pending_offset = 0;
+    }
+    if (!(output = PyString_FromStringAndSize(NULL, 0)))
+        goto exit;
+    
+    if (self->flushing)
+        self->stream.flags |= XD3_FLUSH;
+    self->deferred_source = 1;
+    ok = do_processing(self, self, &output, -1, input_from_pending, process,
+            write_to_string);
+    self->deferred_source = 0;
+    self->stream.flags &= ~XD3_FLUSH;
+    if (!ok)
+        goto exit;
+    
+    if (self->block_wanted) {
+        ret = Py_BuildValue("(OK)", output, (unsigned PY_LONG_LONG) self->source->getblkno);
+        goto exit;
+    }
+    if (self->pending_held) {
+        PyBuffer_Release(&self->pending);
+        self->pending_held = 0;
+    }
+    if (self->flushing) {
+        self->flushing = 0;
+        if (self->indexed && !write_index(self, write_to_string, &output))
+            goto exit;
+    }
+    ret = Py_BuildValue("(OO)", output, Py_None);
+    
+exit:
+    Py_XDECREF(output);
+    self->busy = 0;
+    return ret;
+}
+
+
 static PyObject *stream_get_source(xd3py_stream *self, void *closure) {
     (void) closure;
     
@@ -315,8 +933,55 @@ static PyObject *stream_get_source(xd3py_stream *self, void *closure) {
 }
 
 
+/**
+ * Return the performance counters accumulated by the stream as a dictionary.
+ * 
+ * engine_time is the time spent encoding or decoding, excluding the time spent
+ * fetching source blocks, which is reported separately as source_time along
+ * with input_time and output_time for the file callbacks. All times are in
+ * seconds. cache_hits and cache_misses count source block lookups, and
+ * cache_hit_ratio is the proportion of them that were hits, or zero (0) if
+ * there were none; compressed_hits counts the misses restored from the
+ * compressed cache, and blocks_read the blocks read from the source. bytes_in
+ * and bytes_out count the data consumed and produced, and spill_bytes the
+ * output that was held for later reads because it exceeded the amount
+ * requested. windows is the number of windows completed.
+ * 
+ * @param self a pointer to the stream instance.
+ * @param closure unused.
+ * @return a pointer to a new dictionary on success; NULL otherwise.
+ */
+static PyObject *stream_get_stats(xd3py_stream *self, void *closure) {
+    const stream_stats *const stats = &self->stats;
+    const ulong lookups = stats->cache_hits + stats->cache_misses;
+    (void) closure;
+    
+    return Py_BuildValue("{s:d,s:d,s:d,s:d,s:k,s:k,s:d,s:k,s:k,s:L,s:L,s:L,s:k}",
+            "engine_time", stats->engine_time,
+            "input_time", stats->input_time,
+            "output_time", stats->output_time,
+            "source_time", stats->source_time,
+            "cache_hits", stats->cache_hits,
+            "cache_misses", stats->cache_misses,
+            "cache_hit_ratio", (lookups > 0) ? (double) stats->cache_hits / lookups : 0.0,
+            "compressed_hits", stats->compressed_hits,
+            "blocks_read", stats->blocks_read,
+            "bytes_in", stats->bytes_in,
+            "bytes_out", stats->bytes_out,
+            "spill_bytes", stats->spill_bytes,
+            "windows", stats->windows);
+}
+
+
+static PyObject *stream_get_block_size(xd3py_stream *self, void *closure) {
+    (void) closure;
+    
+    return PyLong_FromUnsignedLong(self->block_size);
+}
+
+
 static int stream_set_source(xd3py_stream *self, PyObject *value, void *closure) {
-    PyObject *temp;
+    int result;
     (void) closure;
 
     if (value == NULL) {
@@ -330,21 +995,81 @@ static int stream_set_source(xd3py_stream *self, PyObject *value, void *closure)
     }
     if ((value != Py_None) && (file_object_check(value) == -1))
         return -1;
+    // The engine may be running on another thread between windows, and the
+    // source object's methods may let one start while it is replaced.
+    if (!enter_stream(self))
+        return -1;
+    result = replace_source(self, value);
+    self->busy = 0;
+    return result;
+}
+
+
+/**
+ * Replace the source of a stream, along with its cache and reader. The stream
+ * must be held with enter_stream.
+ * 
+ * @param self a pointer to the stream instance.
+ * @param value a pointer to the new source file object, or None.
+ * @return 0 on success; -1 otherwise.
+ */
+static int replace_source(xd3py_stream *const self, PyObject *value) {
+    PyObject *temp;
+    PY_LONG_LONG origin = -1;
+    lru_cache_t *cache = NULL;
+    compressed_cache_t *compressed = NULL;
+    shared_cache_source_t *shared = NULL;
+    ulong block_size = self->block_size;
 
     if (self->source == NULL) {
         self->source = calloc(1, sizeof(xd3_source));
         if (self->source == NULL)
             return -1;
-        
-        self->source->max_winsize = SOURCE_BLOCK_SIZE * MAX_SOURCE_BLOCKS;
-        self->source->blksize = SOURCE_BLOCK_SIZE;
     }
-
+    // The cache is replaced along with the source so that no blocks of the
+    // previous source survive, and so that it can be sized to suit.
+    if (value != Py_None) {
+        origin = get_source_origin(value);
+        block_size = choose_block_size(self, get_source_size(value, origin));
+        if (SHARED_SOURCE_CACHE && (self->source_key != NULL)) {
+            shared = shared_cache_open(PyString_AS_STRING(self->source_key), block_size);
+            if (shared == NULL) {
+                PyErr_NoMemory();
+                return -1;
+            }
+        } else if (((cache = lru_cache_init(self->cache_blocks, block_size,
+                self->cache_policy)) == NULL) || ((self->compressed_capacity > 0)
+                && ((compressed = compressed_cache_init(self->compressed_capacity)) == NULL))) {
+            lru_cache_free(cache);
+            PyErr_NoMemory();
+            return -1;
+        }
+        if (compressed != NULL)
+            lru_cache_on_evict(cache, stash_block, self);
+    }
+    lru_cache_free(self->cache);
+    compressed_cache_free(self->compressed);
+    close_shared_source(self);
+    self->cache = cache;
+    self->compressed = compressed;
+    self->shared = shared;
+    self->block_size = block_size;
+
+    // Nothing in the source may still refer to blocks of the previous cache.
     temp = self->source->ioh;
+    memset(self->source, 0, sizeof(xd3_source));
     Py_INCREF(value);
     self->source->ioh = value;
+    self->source->max_winsize = self->block_size * self->cache_blocks;
+    self->source->blksize = self->block_size;
     Py_XDECREF(temp);
     
+    self->source_block = 0;
+    self->source_origin = origin;
+    source_reader_free(self->reader);
+    self->reader = (value != Py_None)
+            ? open_source_reader(value, self->source_origin, self->block_size) : NULL;
+    
     if (value != Py_None)
         xd3_set_source(&self->stream, self->source);
     else
@@ -354,62 +1079,1191 @@ static int stream_set_source(xd3py_stream *self, PyObject *value, void *closure)
 }
 
 
-static int get_source_block(xd3_stream *stream, xd3_source *source, xoff_t block) {
-    lru_cache_t *const cache = ((xd3py_stream *) stream->opaque)->cache;
-    const lru_cache_entry_t *entry = lru_cache_get(cache, (ulong) block);
-	
-    if (entry == NULL) {
-        const lru_cache_entry_t *recent = lru_cache_last(cache);
-        ulong id = (recent != NULL) ? recent->id + 1 : 0;
-        PyObject *data = NULL;
-        
-        for (; id <= block; id++) {
-            data = read_from_file(source->ioh, -1, SOURCE_BLOCK_SIZE);
-            if (data != NULL) {
-                char *bytes;
-                Py_ssize_t length;
-                if (PyString_AsStringAndSize(data, &bytes, &length) == -1)
-                    break;
-                entry = lru_cache_put(cache, id, bytes, (ulong) length);
-                Py_CLEAR(data);
+/**
+ * Encode data held in memory in a single call.
+ * 
+ * Unlike a stream, no file objects or source cache are involved: the target
+ * and source buffers are used in place, and the GIL is released while the
+ * engine runs. This suits small and medium inputs that are already in memory.
+ * 
+ * Ownership of the returned string is passed to the caller.
+ * 
+ * @param module unused.
+ * @param args a pointer to a tuple containing the positional argument target,
+ *             the data to encode, and optionally source, the data to encode
+ *             it against. Both accept the same objects as Stream.write.
+ * @param kwds a pointer to a dictionary that may contain the arguments above
+ *             and the tuning arguments "level", "matcher", "secondary" and
+ *             "winsize" accepted by Stream.
+ * @return a pointer to a string containing the delta on success; NULL
+ *         otherwise.
+ */
+static PyObject *module_encode(PyObject *module, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"target", "source", "level", "matcher", "secondary", "winsize",
+            NULL};
+    PyObject *target_object;
+    PyObject *source_object = Py_None;
+    int level = DEFAULT_LEVEL;
+    const char *matcher = NULL;
+    const char *secondary = DEFAULT_SECONDARY;
+    Py_ssize_t winsize = XD3_DEFAULT_WINSIZE;
+    Py_buffer target;
+    Py_buffer source = {NULL};
+    PyObject *result = NULL;
+    xd3_config config;
+    (void) module;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|Oizzn", kwlist, &target_object,
+            &source_object, &level, &matcher, &secondary, &winsize))
+        return NULL;
+    if (!get_content_buffer(target_object, &target))
+        return NULL;
+    if ((source_object != Py_None) && !get_content_buffer(source_object, &source))
+        goto exit;
+    if ((target.len > UINT32_MAX) || (source.len > UINT32_MAX)) {
+        PyErr_SetString(PyExc_ValueError, "data is too large to encode in memory");
+        goto exit;
+    }
+    if (!configure_stream(&config, level, matcher, secondary, winsize))
+        goto exit;
+    fit_window(&config, target.len);
+
+    {
+        usize_t capacity = encode_capacity(target.len);
+        for (;;) {
+            usize_t length;
+            int ret;
+            if ((result = PyString_FromStringAndSize(NULL, capacity)) == NULL)
+                goto exit;
+            Py_BEGIN_ALLOW_THREADS
+            ret = encode_memory(&target, &source, &config, (uint8_t *) PyString_AS_STRING(result),
+                    &length, capacity);
+            Py_END_ALLOW_THREADS
+            if ((ret == ENOSPC) && (capacity < UINT32_MAX)) {
+                Py_CLEAR(result);
+                capacity = (usize_t) xd3_min((xoff_t) capacity * 2, UINT32_MAX);
+                continue;
+            }
+            if (ret != 0) {
+                Py_CLEAR(result);
+                if (ret == ENOMEM)
+                    PyErr_NoMemory();
+                else
+                    PyErr_SetString(PyExc_IOError, xd3_strerror(ret) ? xd3_strerror(ret)
+                            : "encoding failed");
             } else
-                break;
+                _PyString_Resize(&result, length);
+            break;
         }
-        
-        Py_XDECREF(data);
-        if ((entry != NULL) && (entry->id != block))
-            entry = NULL;
-    }
-    if (entry != NULL) {
-        source->curblkno = entry->id;
-        source->onblk = entry->size;
-        source->curblk = (uint8_t *) entry->data;
-        return 0;
     }
-    return XD3_TOOFARBACK;
+    
+exit:
+    PyBuffer_Release(&source);
+    PyBuffer_Release(&target);
+    return result;
 }
 
 
-static PyObject *read_from_file(PyObject *const file, const size_t offset,
-        const size_t max_length) {
-    PyObject *const block = PyObject_CallMethod(file, "read", "n", max_length);
-    if ((block == NULL) || !PyString_Check(block)) {
-        Py_XDECREF(block);
+/**
+ * Decode a delta held in memory in a single call.
+ * 
+ * As with encode, the buffers are used in place and the GIL is released while
+ * the engine runs.
+ * 
+ * Ownership of the returned string is passed to the caller.
+ * 
+ * @param module unused.
+ * @param args a pointer to a tuple containing the positional argument delta,
+ *             the encoded data, and optionally source, the data it was
+ *             encoded against.
+ * @param kwds a pointer to a dictionary that may contain the arguments above.
+ * @return a pointer to a string containing the decoded data on success; NULL
+ *         otherwise.
+ */
+static PyObject *module_decode(PyObject *module, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"delta", "source", NULL};
+    PyObject *delta_object;
+    PyObject *source_object = Py_None;
+    Py_buffer delta;
+    Py_buffer source = {NULL};
+    PyObject *result = NULL;
+    (void) module;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist, &delta_object, &source_object))
+        return NULL;
+    if (!get_content_buffer(delta_object, &delta))
         return NULL;
+    if ((source_object != Py_None) && !get_content_buffer(source_object, &source))
+        goto exit;
+    if ((delta.len > UINT32_MAX) || (source.len > UINT32_MAX)) {
+        PyErr_SetString(PyExc_ValueError, "data is too large to decode in memory");
+        goto exit;
     }
-    return block;
+
+    {
+        usize_t capacity = decode_capacity(delta.len, source.len);
+        for (;;) {
+            usize_t length;
+            int ret;
+            if ((result = PyString_FromStringAndSize(NULL, capacity)) == NULL)
+                goto exit;
+            Py_BEGIN_ALLOW_THREADS
+            ret = xd3_decode_memory((const uint8_t *) delta.buf, (usize_t) delta.len,
+                    (const uint8_t *) source.buf, (usize_t) source.len,
+                    (uint8_t *) PyString_AS_STRING(result), &length, capacity, 0);
+            Py_END_ALLOW_THREADS
+            if ((ret == ENOSPC) && (capacity < UINT32_MAX)) {
+                Py_CLEAR(result);
+                capacity = (usize_t) xd3_min((xoff_t) capacity * 2, UINT32_MAX);
+                continue;
+            }
+            if (ret != 0) {
+                Py_CLEAR(result);
+                if (ret == ENOMEM)
+                    PyErr_NoMemory();
+                else
+                    PyErr_SetString(PyExc_IOError, xd3_strerror(ret) ? xd3_strerror(ret)
+                            : "decoding failed");
+            } else
+                _PyString_Resize(&result, length);
+            break;
+        }
+    }
+    
+exit:
+    PyBuffer_Release(&source);
+    PyBuffer_Release(&delta);
+    return result;
+}
+
+
+/**
+ * Encode many targets, each against its own optional source, in parallel.
+ * 
+ * The pairs are divided between a pool of native threads that run with the
+ * GIL released. Each pair is encoded exactly as by encode.
+ * 
+ * Ownership of the returned list is passed to the caller.
+ * 
+ * @param module unused.
+ * @param args a pointer to a tuple containing the positional argument pairs, a
+ *             sequence of (target, source) tuples in which source may be None,
+ *             and optionally threads, the maximum number of threads to use.
+ *             If threads is zero (0), omitted or greater than the number of
+ *             processors, one thread per processor is used.
+ * @param kwds a pointer to a dictionary that may contain the arguments above
+ *             and the tuning arguments accepted by encode.
+ * @return a pointer to a list of deltas, in the order of the pairs, on
+ *         success; NULL otherwise.
+ */
+static PyObject *module_encode_many(PyObject *module, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"pairs", "threads", "level", "matcher", "secondary", "winsize",
+            NULL};
+    PyObject *pairs;
+    Py_ssize_t threads = 0;
+    int level = DEFAULT_LEVEL;
+    const char *matcher = NULL;
+    const char *secondary = DEFAULT_SECONDARY;
+    Py_ssize_t winsize = XD3_DEFAULT_WINSIZE;
+    xd3_config config;
+    (void) module;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|nizzn", kwlist, &pairs, &threads, &level,
+            &matcher, &secondary, &winsize))
+        return NULL;
+    if (!configure_stream(&config, level, matcher, secondary, winsize))
+        return NULL;
+    return process_batch(pairs, threads, &config);
+}
+
+
+/**
+ * Decode many deltas, each against its own optional source, in parallel.
+ * 
+ * As with encode_many, the pairs are divided between a pool of native threads
+ * that run with the GIL released.
+ * 
+ * Ownership of the returned list is passed to the caller.
+ * 
+ * @param module unused.
+ * @param args a pointer to a tuple containing the positional argument pairs, a
+ *             sequence of (delta, source) tuples in which source may be None,
+ *             and optionally threads, the maximum number of threads to use.
+ * @param kwds a pointer to a dictionary that may contain the arguments above.
+ * @return a pointer to a list of decoded strings, in the order of the pairs,
+ *         on success; NULL otherwise.
+ */
+static PyObject *module_decode_many(PyObject *module, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"pairs", "threads", NULL};
+    PyObject *pairs;
+    Py_ssize_t threads = 0;
+    (void) module;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|n", kwlist, &pairs, &threads))
+        return NULL;
+    return process_batch(pairs, threads, NULL);
+}
+
+
+/**
+ * Encode or decode a sequence of pairs using a pool of native threads.
+ * 
+ * The buffers of every pair are obtained before the GIL is released, and the
+ * results are converted to strings once all of the threads have finished.
+ * 
+ * @param pairs a pointer to a sequence of (data, source) tuples.
+ * @param threads the maximum number of threads, no more than one per
+ *                processor; zero (0) for one per processor.
+ * @param config a pointer to the engine configuration used to encode each
+ *               pair, or NULL to decode them.
+ * @return a pointer to a list of results on success; NULL otherwise.
+ */
+static PyObject *process_batch(PyObject *pairs, const Py_ssize_t threads,
+        const xd3_config *const config) {
+    PyObject *sequence;
+    PyObject *result = NULL;
+    batch work;
+    Py_ssize_t count;
+    Py_ssize_t prepared = 0;
+    Py_ssize_t i;
+
+    if (threads < 0) {
+        PyErr_SetString(PyExc_ValueError, "threads cannot be negative");
+        return NULL;
+    }
+    if ((sequence = PySequence_Fast(pairs, "pairs must be a sequence")) == NULL)
+        return NULL;
+    count = PySequence_Fast_GET_SIZE(sequence);
+    work.encoding = config != NULL;
+    if ((work.jobs = calloc(xd3_max(count, 1), sizeof(batch_job))) == NULL) {
+        PyErr_NoMemory();
+        goto exit;
+    }
+
+    for (; prepared < count; prepared++) {
+        PyObject *const item = PySequence_Fast_GET_ITEM(sequence, prepared);
+        batch_job *const job = &work.jobs[prepared];
+        PyObject *source;
+        if (!PyTuple_Check(item) || (PyTuple_GET_SIZE(item) != 2)) {
+            PyErr_SetString(PyExc_TypeError, "pairs must contain (data, source) tuples");
+            goto exit;
+        }
+        if (!get_content_buffer(PyTuple_GET_ITEM(item, 0), &job->input))
+            goto exit;
+        source = PyTuple_GET_ITEM(item, 1);
+        if ((source != Py_None) && !get_content_buffer(source, &job->source)) {
+            PyBuffer_Release(&job->input);
+            goto exit;
+        }
+        if ((job->input.len > UINT32_MAX) || (job->source.len > UINT32_MAX)) {
+            PyErr_Format(PyExc_ValueError, "item %zd is too large to process in memory",
+                    prepared);
+            prepared++;
+            goto exit;
+        }
+        if (config != NULL) {
+            job->config = *config;
+            fit_window(&job->config, job->input.len);
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    thread_pool_run((ulong) threads, (ulong) count, run_batch_job, &work);
+    Py_END_ALLOW_THREADS
+
+    for (i = 0; i < count; i++) {
+        const int ret = work.jobs[i].ret;
+        if (ret == ENOMEM) {
+            PyErr_NoMemory();
+            goto exit;
+        } else if (ret != 0) {
+            PyErr_Format(PyExc_IOError, "item %zd: %s", i,
+                    xd3_strerror(ret) ? xd3_strerror(ret) : strerror(ret));
+            goto exit;
+        }
+    }
+    if ((result = PyList_New(count)) == NULL)
+        goto exit;
+    for (i = 0; i < count; i++) {
+        PyObject *const data = PyString_FromStringAndSize((char *) work.jobs[i].output,
+                work.jobs[i].length);
+        if (data == NULL) {
+            Py_CLEAR(result);
+            goto exit;
+        }
+        PyList_SET_ITEM(result, i, data);
+    }
+    
+exit:
+    if (work.jobs != NULL) {
+        for (i = 0; i < prepared; i++) {
+            PyBuffer_Release(&work.jobs[i].input);
+            PyBuffer_Release(&work.jobs[i].source);
+            free(work.jobs[i].output);
+        }
+        free(work.jobs);
+    }
+    Py_DECREF(sequence);
+    return result;
+}
+
+
+/**
+ * Encode or decode one item of a batch. This is run by the thread pool without
+ * the GIL.
+ * 
+ * @param context a pointer to the batch.
+ * @param index the index of the job to run.
+ */
+static void run_batch_job(void *context, const ulong index) {
+    const batch *const work = (const batch *) context;
+    batch_job *const job = &work->jobs[index];
+    usize_t capacity = work->encoding ? encode_capacity(job->input.len)
+            : decode_capacity(job->input.len, job->source.len);
+
+    for (;;) {
+        if ((job->output = malloc(capacity)) == NULL) {
+            job->ret = ENOMEM;
+            return;
+        }
+        if (work->encoding)
+            job->ret = encode_memory(&job->input, &job->source, &job->config, job->output,
+                    &job->length, capacity);
+        else
+            job->ret = xd3_decode_memory((const uint8_t *) job->input.buf,
+                    (usize_t) job->input.len, (const uint8_t *) job->source.buf,
+                    (usize_t) job->source.len, job->output, &job->length, capacity, 0);
+        if ((job->ret != ENOSPC) || (capacity == UINT32_MAX))
+            break;
+        free(job->output);
+        capacity = (usize_t) xd3_min((xoff_t) capacity * 2, UINT32_MAX);
+    }
+    if (job->ret != 0) {
+        free(job->output);
+        job->output = NULL;
+    }
+}
+
+
+/**
+ * Combine a chain of deltas held in memory into a single delta.
+ * 
+ * Each delta must have been encoded against the target of the one before it,
+ * so that decoding the first against some source, then each of the others
+ * against the result of the one before, produces the latest version. The
+ * merged delta produces that version from the same source in a single
+ * decode, and is computed from the instructions of the deltas alone: neither
+ * the source nor any intermediate version is needed. The GIL is released
+ * while the deltas are merged.
+ * 
+ * Ownership of the returned string is passed to the caller.
+ * 
+ * @param module unused.
+ * @param args a pointer to a tuple containing the positional argument deltas,
+ *             a non-empty sequence of deltas from oldest to newest, each of
+ *             which accepts the same objects as Stream.write.
+ * @param kwds a pointer to a dictionary that may contain the argument above
+ *             and the tuning argument "secondary" accepted by Stream.
+ * @return a pointer to a string containing the merged delta on success; NULL
+ *         otherwise.
+ */
+static PyObject *module_merge(PyObject *module, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"deltas", "secondary", NULL};
+    PyObject *deltas_object;
+    const char *secondary = DEFAULT_SECONDARY;
+    PyObject *sequence;
+    Py_buffer *views = NULL;
+    const uint8_t **deltas = NULL;
+    usize_t *lengths = NULL;
+    Py_ssize_t count;
+    Py_ssize_t held = 0;
+    uint8_t *output = NULL;
+    usize_t output_size = 0;
+    const char *message = "";
+    PyObject *result = NULL;
+    xd3_config config;
+    int ret;
+    (void) module;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|z", kwlist, &deltas_object, &secondary))
+        return NULL;
+    if (!configure_stream(&config, DEFAULT_LEVEL, NULL, secondary, XD3_DEFAULT_WINSIZE))
+        return NULL;
+    if ((sequence = PySequence_Fast(deltas_object, "deltas must be a sequence")) == NULL)
+        return NULL;
+    if ((count = PySequence_Fast_GET_SIZE(sequence)) == 0) {
+        PyErr_SetString(PyExc_ValueError, "at least one delta is required");
+        goto exit;
+    }
+    views = (Py_buffer *) PyMem_Malloc(count * sizeof(Py_buffer));
+    deltas = (const uint8_t **) PyMem_Malloc(count * sizeof(uint8_t *));
+    lengths = (usize_t *) PyMem_Malloc(count * sizeof(usize_t));
+    if ((views == NULL) || (deltas == NULL) || (lengths == NULL)) {
+        PyErr_NoMemory();
+        goto exit;
+    }
+    for (; held < count; held++) {
+        if (!get_content_buffer(PySequence_Fast_GET_ITEM(sequence, held), &views[held]))
+            goto exit;
+        if (views[held].len > UINT32_MAX) {
+            PyErr_SetString(PyExc_ValueError, "data is too large to merge in memory");
+            PyBuffer_Release(&views[held]);
+            goto exit;
+        }
+        deltas[held] = (const uint8_t *) views[held].buf;
+        lengths[held] = (usize_t) views[held].len;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = delta_merge(deltas, lengths, (ulong) count, &config, &output, &output_size, &message);
+    Py_END_ALLOW_THREADS
+    if (ret == ENOMEM)
+        PyErr_NoMemory();
+    else if (ret != 0)
+        PyErr_SetString(PyExc_IOError, (*message != '\0') ? message
+                : xd3_strerror(ret) ? xd3_strerror(ret) : "merging failed");
+    else
+        result = PyString_FromStringAndSize((const char *) output, output_size);
+    free(output);
+
+exit:
+    while (held > 0)
+        PyBuffer_Release(&views[--held]);
+    PyMem_Free(lengths);
+    PyMem_Free(deltas);
+    PyMem_Free(views);
+    Py_DECREF(sequence);
+    return result;
+}
+
+
+/**
+ * Index the windows of a delta file so that it can be decoded from any window.
+ * 
+ * If the delta embeds an index, written by a stream created with index=True,
+ * only that and the file header are read. Otherwise, only the file header and
+ * window headers are read; the remainder of each window is skipped by seeking.
+ * The file is indexed from its current position, which is restored
+ * afterwards.
+ * 
+ * Ownership of the returned tuple is passed to the caller.
+ * 
+ * @param module unused.
+ * @param args a pointer to a tuple containing the positional argument delta, a
+ *             seekable file-like object.
+ * @param kwds a pointer to a dictionary that may contain the argument above.
+ * @return a pointer to a tuple on success; NULL otherwise. The tuple contains
+ *         the file header, which must be given to a decoder before any
+ *         window, and a list of (delta_offset, target_offset, target_length)
+ *         tuples, one per window, in which delta_offset is relative to the
+ *         starting position of the file.
+ */
+static PyObject *module_scan_windows(PyObject *module, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"delta", NULL};
+    delta_file delta;
+    window_index_t index;
+    PyObject *windows = NULL;
+    PyObject *result = NULL;
+    PyObject *position;
+    ulong i;
+    int ret;
+    (void) module;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &delta.file))
+        return NULL;
+    if ((position = PyObject_CallMethod(delta.file, "tell", NULL)) == NULL)
+        return NULL;
+    delta.origin = PyLong_AsLongLong(position);
+    Py_DECREF(position);
+    if (PyErr_Occurred())
+        return NULL;
+
+    ret = window_index_scan(&index, read_delta, &delta);
+    if ((position = PyObject_CallMethod(delta.file, "seek", "L", delta.origin)) == NULL)
+        goto exit;
+    Py_DECREF(position);
+    switch (ret) {
+        case 0:
+            break;
+        case ENOMEM:
+            PyErr_NoMemory();
+            goto exit;
+        case XD3_UNIMPLEMENTED:
+            PyErr_SetString(PyExc_IOError, "delta uses an unsupported VCDIFF feature");
+            goto exit;
+        case XD3_INVALID_INPUT:
+            PyErr_SetString(PyExc_IOError, "delta is not a valid VCDIFF file");
+            goto exit;
+        default:
+            // The read method raised an exception.
+            goto exit;
+    }
+
+    if ((windows = PyList_New(index.count)) == NULL)
+        goto exit;
+    for (i = 0; i < index.count; i++) {
+        const window_entry_t *const entry = &index.windows[i];
+        PyObject *const item = Py_BuildValue("(KKk)", (unsigned PY_LONG_LONG) entry->delta_offset,
+                (unsigned PY_LONG_LONG) entry->target_offset, (ulong) entry->target_length);
+        if (item == NULL)
+            goto exit;
+        PyList_SET_ITEM(windows, i, item);
+    }
+    result = Py_BuildValue("(s#O)", (char *) index.header, (Py_ssize_t) index.header_size,
+            windows);
+    
+exit:
+    Py_XDECREF(windows);
+    window_index_free(&index);
+    return result;
+}
+
+
+/**
+ * Set the number of bytes of source data that the cache shared by streams may
+ * retain once no stream is using it. Blocks in use are never evicted, so the
+ * cache may briefly exceed its capacity.
+ * 
+ * Ownership of the returned None object is passed to the caller.
+ * 
+ * @param module unused.
+ * @param args a pointer to a tuple containing the positional argument size,
+ *             the capacity in bytes.
+ * @param kwds a pointer to a dictionary that may contain the argument above.
+ * @return a pointer to None on success; NULL otherwise.
+ */
+static PyObject *module_set_shared_cache_capacity(PyObject *module, PyObject *args,
+        PyObject *kwds) {
+    static char *kwlist[] = {"size", NULL};
+    Py_ssize_t size;
+    (void) module;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n", kwlist, &size))
+        return NULL;
+    if (size < 0) {
+        PyErr_SetString(PyExc_ValueError, "size must not be negative");
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    shared_cache_set_capacity((ulong) size);
+    Py_END_ALLOW_THREADS
+    Py_RETURN_NONE;
+}
+
+
+/**
+ * Set the number of bytes that the source caches of all streams may allocate
+ * between them, including the shared cache. A cache that reaches the budget
+ * replaces its own blocks instead of growing, though each may always hold one
+ * block, and the shared cache gives up blocks no stream is using. Memory
+ * already allocated is not released if the budget is lowered.
+ * 
+ * Ownership of the returned None object is passed to the caller.
+ * 
+ * @param module unused.
+ * @param args a pointer to a tuple containing the positional argument size,
+ *             the budget in bytes, or zero (0) for no limit.
+ * @param kwds a pointer to a dictionary that may contain the argument above.
+ * @return a pointer to None on success; NULL otherwise.
+ */
+static PyObject *module_set_cache_budget(PyObject *module, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"size", NULL};
+    Py_ssize_t size;
+    (void) module;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n", kwlist, &size))
+        return NULL;
+    if (size < 0) {
+        PyErr_SetString(PyExc_ValueError, "size must not be negative");
+        return NULL;
+    }
+    lru_cache_set_budget((ulong) size);
+    Py_RETURN_NONE;
+}
+
+
+/**
+ * Report the memory used by the source caches of all streams.
+ * 
+ * Ownership of the returned dictionary is passed to the caller.
+ * 
+ * @param module unused.
+ * @return a pointer to a dictionary on success; NULL otherwise. It contains
+ *         allocated, the number of bytes currently allocated for source blocks
+ *         by all caches, and budget, the limit set by set_cache_budget; and
+ *         shared_allocated and shared_capacity, the part of that allocated by
+ *         the shared cache and the most it retains.
+ */
+static PyObject *module_cache_usage(PyObject *module) {
+    (void) module;
+    
+    return Py_BuildValue("{s:k,s:k,s:k,s:k}", "allocated", lru_cache_allocated(),
+            "budget", lru_cache_get_budget(), "shared_allocated", shared_cache_allocated(),
+            "shared_capacity", shared_cache_get_capacity());
+}
+
+
+/**
+ * Read part of a delta file for window_index_scan.
+ * 
+ * @param context a pointer to the delta_file being indexed.
+ * @param offset the position to read from, relative to the origin of the file.
+ * @param dest a pointer to the memory to store the data.
+ * @param length the number of bytes to read.
+ * @return the number of bytes read; -1, with an exception set, on error.
+ */
+static long read_delta(void *context, const xoff_t offset, uint8_t *dest, const usize_t length) {
+    const delta_file *const delta = (const delta_file *) context;
+    PyObject *result;
+    Py_ssize_t size;
+
+    result = PyObject_CallMethod(delta->file, "seek", "L", delta->origin + (PY_LONG_LONG) offset);
+    if (result == NULL)
+        return -1;
+    Py_DECREF(result);
+    if ((result = read_from_file(delta->file, (size_t) offset, length)) == NULL) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_TypeError, "read must return a string");
+        return -1;
+    }
+    size = xd3_min(PyString_GET_SIZE(result), (Py_ssize_t) length);
+    memcpy(dest, PyString_AS_STRING(result), size);
+    Py_DECREF(result);
+    return (long) size;
+}
+
+
+/**
+ * Encode a target buffer against an optional source buffer with a configured
+ * stream, following the example given for xd3_encode_stream.
+ * 
+ * This does not use the interpreter, so it may be called without the GIL.
+ * 
+ * @param target a pointer to the data to encode.
+ * @param source a pointer to the source data; its buf field is NULL if there
+ *               is no source.
+ * @param config a pointer to the engine configuration.
+ * @param output a pointer to the region in which the delta is stored.
+ * @param length a pointer to where the length of the delta is stored.
+ * @param capacity the size of the output region.
+ * @return 0 on success; ENOSPC if the output region is too small; another
+ *         engine error code otherwise.
+ */
+static int encode_memory(const Py_buffer *const target, const Py_buffer *const source,
+        xd3_config *const config, uint8_t *const output, usize_t *const length,
+        const usize_t capacity) {
+    xd3_stream stream;
+    xd3_source src;
+    int ret;
+
+    memset(&stream, 0, sizeof stream);
+    if ((ret = xd3_config_stream(&stream, config)) != 0)
+        goto exit;
+    if ((source->buf != NULL) && (source->len > 0)) {
+        memset(&src, 0, sizeof src);
+        src.blksize = (usize_t) source->len;
+        src.onblk = (usize_t) source->len;
+        src.curblk = (const uint8_t *) source->buf;
+        src.curblkno = 0;
+        src.max_winsize = (xoff_t) source->len;
+        if ((ret = xd3_set_source_and_size(&stream, &src, (xoff_t) source->len)) != 0)
+            goto exit;
+    }
+    // The engine expects a non-NULL input pointer even when it is empty.
+    ret = xd3_encode_stream(&stream, (target->buf != NULL) ? (const uint8_t *) target->buf
+            : (const uint8_t *) "", (usize_t) target->len, output, length, capacity);
+    
+exit:
+    xd3_free_stream(&stream);
+    return ret;
+}
+
+
+/**
+ * Supply the engine with a block of source data.
+ * 
+ * This is called from within the engine while the GIL is released. Blocks
+ * already held in the cache are returned without touching the interpreter, as
+ * are those read natively from a real file straight into a cache entry; the
+ * GIL is only re-acquired when the source file object must be read.
+ * 
+ * A seekable source is positioned directly at the requested block, so any
+ * block can be fetched again after it has been evicted from the cache. Other
+ * sources can only be read forwards from their current position.
+ * 
+ * During encode_step and decode_step nothing is read: a block missing from the
+ * cache is requested from the caller by returning XD3_GETSRCBLK, and the engine
+ * asks for it again once processing resumes.
+ * 
+ * @param stream a pointer to the engine stream requesting the block.
+ * @param source a pointer to the source being read.
+ * @param block the number of the block to fetch.
+ * @return 0 on success; XD3_GETSRCBLK if the caller must supply the block;
+ *         XD3_TOOFARBACK if the block cannot be obtained.
+ */
+static int get_source_block(xd3_stream *stream, xd3_source *source, xoff_t block) {
+    xd3py_stream *const self = (xd3py_stream *) stream->opaque;
+    const lru_cache_entry_t *entry = cache_get(self, (ulong) block);
+    const double start = monotonic_time();
+	
+    if (entry != NULL)
+        self->stats.cache_hits++;
+    else
+        self->stats.cache_misses++;
+    if ((entry == NULL) && (self->compressed != NULL)) {
+        if (restore_block(self, (ulong) block, &entry))
+            self->stats.compressed_hits++;
+        self->stats.source_time += monotonic_time() - start;
+    }
+    if ((entry == NULL) && self->deferred_source)
+        return XD3_GETSRCBLK;
+    if ((entry == NULL) && (self->reader != NULL)) {
+        lru_cache_entry_t *const slot = cache_claim(self, (ulong) block);
+        const long length = (slot != NULL)
+                ? source_reader_read(self->reader, (ulong) block, slot->data) : -1;
+        self->stats.source_time += monotonic_time() - start;
+        if (length < 0) {
+            const int locked = acquire_gil(self);
+            if (slot != NULL) {
+                PyErr_SetFromErrno(PyExc_IOError);
+                cache_abandon(self, slot);
+            } else
+                PyErr_NoMemory();
+            if (locked)
+                release_gil(self);
+            return XD3_INTERNAL;
+        }
+        slot->size = (ulong) length;
+        self->stats.blocks_read++;
+        entry = cache_publish(self, slot);
+    } else if (entry == NULL) {
+        ulong id = self->source_block;
+        PyObject *data = NULL;
+        const int locked = acquire_gil(self);
+        
+        if ((id != block) && (self->source_origin >= 0)) {
+            PyObject *const result = PyObject_CallMethod(source->ioh, "seek", "L",
+                    self->source_origin + (PY_LONG_LONG) block * self->block_size);
+            // The position of the source is unknown after a failed seek, so
+            // nothing more can be read from it.
+            if (result == NULL) {
+                if (locked)
+                    release_gil(self);
+                self->stats.source_time += monotonic_time() - start;
+                return XD3_INTERNAL;
+            }
+            Py_DECREF(result);
+            id = (ulong) block;
+        }
+        for (; id <= block; id++) {
+            data = read_from_file(source->ioh, -1, self->block_size);
+            if (data != NULL) {
+                char *bytes;
+                Py_ssize_t length;
+                if (PyString_AsStringAndSize(data, &bytes, &length) == -1)
+                    break;
+                // Only the requested block is held; any before it are not.
+                if (entry != NULL)
+                    cache_release(self, entry);
+                if ((entry = cache_put(self, id, bytes, (ulong) length)) == NULL) {
+                    PyErr_NoMemory();
+                    break;
+                }
+                self->source_block = id + 1;
+                self->stats.blocks_read++;
+                Py_CLEAR(data);
+            } else
+                break;
+        }
+        
+        Py_XDECREF(data);
+        if (locked)
+            release_gil(self);
+        self->stats.source_time += monotonic_time() - start;
+        if ((entry != NULL) && (entry->id != block)) {
+            cache_release(self, entry);
+            entry = NULL;
+        }
+    }
+    if (entry != NULL) {
+        cache_hold(self, entry);
+        source->curblkno = entry->id;
+        source->onblk = entry->size;
+        source->curblk = (uint8_t *) entry->data;
+        return 0;
+    }
+    return XD3_TOOFARBACK;
+}
+
+
+/**
+ * Get a source block from the cache of a stream: the shared cache if the
+ * source has been identified, or the stream's own cache otherwise. An entry
+ * from the shared cache is referenced and must be passed to cache_release or
+ * cache_hold.
+ * 
+ * @param self a pointer to the stream instance.
+ * @param block the number of the block.
+ * @return a pointer to the entry; NULL if the block is not cached.
+ */
+static const lru_cache_entry_t *cache_get(xd3py_stream *const self, const ulong block) {
+    return (self->shared != NULL)
+            ? shared_cache_get(self->shared, block) : lru_cache_get(self->cache, block);
+}
+
+
+/**
+ * Claim an entry for a source block so that it can be read in place. The
+ * entry must then be passed to cache_publish or cache_abandon.
+ * 
+ * @param self a pointer to the stream instance.
+ * @param block the number of the block.
+ * @return a pointer to the entry; NULL if there was insufficient memory.
+ */
+static lru_cache_entry_t *cache_claim(xd3py_stream *const self, const ulong block) {
+    return (self->shared != NULL)
+            ? shared_cache_claim(self->shared, block) : lru_cache_claim(self->cache, block);
+}
+
+
+/**
+ * Make an entry filled after cache_claim available for use.
+ * 
+ * @param self a pointer to the stream instance.
+ * @param entry a pointer to the claimed entry.
+ * @return a pointer to the entry to use in its place, referenced as by
+ *         cache_get.
+ */
+static const lru_cache_entry_t *cache_publish(xd3py_stream *const self,
+        lru_cache_entry_t *const entry) {
+    return (self->shared != NULL) ? shared_cache_publish(entry) : entry;
+}
+
+
+/**
+ * Discard an entry obtained from cache_claim that could not be filled, so
+ * that the block is read again when next requested.
+ */
+static void cache_abandon(xd3py_stream *const self, lru_cache_entry_t *const entry) {
+    if (self->shared != NULL)
+        shared_cache_abandon(entry);
+    else
+        lru_cache_remove(self->cache, entry->id);
+}
+
+
+/**
+ * Copy a source block into the cache of a stream.
+ * 
+ * @param self a pointer to the stream instance.
+ * @param block the number of the block.
+ * @param data a pointer to the content of the block.
+ * @param length the length of the block.
+ * @return a pointer to the entry, referenced as by cache_get; NULL if there
+ *         was insufficient memory.
+ */
+static const lru_cache_entry_t *cache_put(xd3py_stream *const self, const ulong block,
+        const char *const data, const ulong length) {
+    return (self->shared != NULL) ? shared_cache_put(self->shared, block, data, length)
+            : lru_cache_put(self->cache, block, data, length);
+}
+
+
+/**
+ * Release an entry obtained from the cache of a stream that will not be used.
+ */
+static void cache_release(xd3py_stream *const self, const lru_cache_entry_t *const entry) {
+    if (self->shared != NULL)
+        shared_cache_release(entry);
+}
+
+
+/**
+ * Keep an entry obtained from the cache of a stream as the block in use by the
+ * engine, releasing the one it used before.
+ */
+static void cache_hold(xd3py_stream *const self, const lru_cache_entry_t *const entry) {
+    if (self->shared == NULL)
+        return;
+    if (self->held_block != NULL)
+        shared_cache_release(self->held_block);
+    self->held_block = entry;
+}
+
+
+/**
+ * Restore a source block from the compressed cache of a stream into its
+ * cache.
+ * 
+ * The compressed block is removed before an entry is claimed for it, as
+ * claiming may compress another block into the cache and evict it. A block
+ * that cannot be restored is left to be read from the source.
+ * 
+ * @param self a pointer to the stream instance.
+ * @param block the number of the block.
+ * @param entry a pointer to receive the restored entry.
+ * @return one (1) if the block was restored; zero (0) otherwise.
+ */
+static int restore_block(xd3py_stream *const self, const ulong block,
+        const lru_cache_entry_t **const entry) {
+    compressed_block_t *const stored = compressed_cache_take(self->compressed, block);
+    lru_cache_entry_t *slot;
+    long length;
+    if (stored == NULL)
+        return 0;
+    
+    slot = lru_cache_claim(self->cache, block);
+    length = (slot != NULL) ? compressed_block_decode(stored, slot->data, self->block_size) : -1;
+    compressed_block_free(stored);
+    if (length < 0) {
+        if (slot != NULL)
+            lru_cache_remove(self->cache, block);
+        return 0;
+    }
+    slot->size = (ulong) length;
+    *entry = slot;
+    return 1;
+}
+
+
+/**
+ * Keep a block evicted from the cache of a stream in its compressed cache.
+ * This is registered with lru_cache_on_evict.
+ * 
+ * @param context a pointer to the stream instance.
+ * @param entry a pointer to the evicted entry.
+ */
+static void stash_block(void *const context, const lru_cache_entry_t *const entry) {
+    xd3py_stream *const self = (xd3py_stream *) context;
+    if (entry->size > 0)
+        compressed_cache_put(self->compressed, entry->id, entry->data, entry->size);
+}
+
+
+/**
+ * Release the shared cache source of a stream and the block it holds, if any.
+ */
+static void close_shared_source(xd3py_stream *const self) {
+    if (self->held_block != NULL)
+        shared_cache_release(self->held_block);
+    self->held_block = NULL;
+    shared_cache_close(self->shared);
+    self->shared = NULL;
+}
+
+
+/**
+ * Determine whether a source can be read at arbitrary positions and, if so,
+ * where it starts.
+ * 
+ * A source is seekable if its seekable method returns true or, lacking that
+ * method, if it has seek and tell methods. Its current position is taken as
+ * the start of the source.
+ * 
+ * @param source a pointer to the source file object.
+ * @return the position of the start of the source; -1 if it is not seekable.
+ */
+static PY_LONG_LONG get_source_origin(PyObject *source) {
+    PY_LONG_LONG origin = -1;
+    PyObject *result;
+
+    if (is_callable(source, "seekable")) {
+        int seekable;
+        if ((result = PyObject_CallMethod(source, "seekable", NULL)) == NULL)
+            goto exit;
+        seekable = PyObject_IsTrue(result);
+        Py_DECREF(result);
+        if (seekable != 1)
+            goto exit;
+    } else if (!is_callable(source, "seek"))
+        goto exit;
+
+    if ((result = PyObject_CallMethod(source, "tell", NULL)) == NULL)
+        goto exit;
+    origin = PyLong_AsLongLong(result);
+    Py_DECREF(result);
+    
+exit:
+    if (PyErr_Occurred() || (origin < 0)) {
+        PyErr_Clear();
+        origin = -1;
+    }
+    return origin;
+}
+
+
+/**
+ * Determine the size of a source, if that can be done cheaply.
+ * 
+ * The size of a real file is taken from the file system. Other seekable
+ * sources are sought to their end and back, and the remainder are measured
+ * with len if they support it.
+ * 
+ * @param source a pointer to the source file object.
+ * @param origin the position of the start of the source, as returned by
+ *               get_source_origin.
+ * @return the number of bytes from the start of the source to its end; -1 if
+ *         it is not known.
+ */
+static PY_LONG_LONG get_source_size(PyObject *source, const PY_LONG_LONG origin) {
+    PY_LONG_LONG size = -1;
+    PyObject *result;
+    const int fd = native_file_descriptor(source, origin);
+
+    if (fd != -1) {
+        struct stat info;
+        if (fstat(fd, &info) == 0)
+            size = (PY_LONG_LONG) info.st_size - origin;
+    } else if (origin >= 0) {
+        if ((result = PyObject_CallMethod(source, "seek", "ii", 0, SEEK_END)) == NULL)
+            goto exit;
+        Py_DECREF(result);
+        if ((result = PyObject_CallMethod(source, "tell", NULL)) != NULL) {
+            size = PyLong_AsLongLong(result) - origin;
+            Py_DECREF(result);
+        }
+        if ((result = PyObject_CallMethod(source, "seek", "L", origin)) == NULL)
+            size = -1;
+        Py_XDECREF(result);
+    } else if (PyObject_HasAttrString(source, "__len__"))
+        size = (PY_LONG_LONG) PyObject_Size(source);
+
+exit:
+    if (PyErr_Occurred() || (size < 0)) {
+        PyErr_Clear();
+        size = -1;
+    }
+    return size;
+}
+
+
+/**
+ * Obtain the file descriptor of a source that is a real file.
+ * 
+ * Only built-in file objects and those from the io module are read natively,
+ * as other objects with a fileno method, such as a DeltaFile, may present
+ * content that differs from that of the underlying file.
+ * 
+ * @param source a pointer to the source file object.
+ * @param origin the position of the start of the source, as returned by
+ *               get_source_origin.
+ * @return the file descriptor; -1 if the source must be read through its
+ *         methods.
+ */
+static int native_file_descriptor(PyObject *source, const PY_LONG_LONG origin) {
+    int fd = -1;
+
+    if ((origin >= 0) && (PyFile_Check(source) || ((native_file_types != NULL)
+            && (PyObject_IsInstance(source, native_file_types) == 1))))
+        fd = PyObject_AsFileDescriptor(source);
+    PyErr_Clear();
+    return fd;
+}
+
+
+/**
+ * Create a native reader for a source that is a real file.
+ * 
+ * @param source a pointer to the source file object.
+ * @param origin the position of the start of the source, as returned by
+ *               get_source_origin.
+ * @param block_size the size of each source block.
+ * @return the reader on success; NULL if the source must be read through its
+ *         methods.
+ */
+static source_reader_t *open_source_reader(PyObject *source, const PY_LONG_LONG origin,
+        const ulong block_size) {
+    const int fd = native_file_descriptor(source, origin);
+
+    return (fd != -1) ? source_reader_init(fd, (off_t) origin, block_size) : NULL;
 }
 
 
-static PyObject *read_from_string(PyObject *const str, const size_t offset,
+static PyObject *read_from_file(PyObject *const file, const size_t offset,
         const size_t max_length) {
-    PyObject *result = PySequence_GetSlice(str, offset, offset + max_length);
-    return result;
+    PyObject *const block = PyObject_CallMethod(file, "read", "n", max_length);
+    if ((block == NULL) || !PyString_Check(block)) {
+        Py_XDECREF(block);
+        return NULL;
+    }
+    return block;
+}
+
+
+/**
+ * Read the next block of input from a file-like object.
+ * 
+ * @param src a pointer to the file object to read.
+ * @param offset the position of the block within the input; unused as the file
+ *               is read sequentially.
+ * @param max_length the maximum number of bytes to read.
+ * @param view a pointer to the view to populate with the block. Ownership is
+ *             passed to the caller, who must release it with PyBuffer_Release.
+ * @return true on success; false otherwise.
+ */
+static int input_from_file(void *const src, const size_t offset, const size_t max_length,
+        Py_buffer *view) {
+    PyObject *const block = read_from_file((PyObject *) src, offset, max_length);
+    int ret;
+    if (block == NULL)
+        return 0;
+    ret = PyObject_GetBuffer(block, view, PyBUF_SIMPLE) == 0;
+    Py_DECREF(block);
+    return ret;
+}
+
+
+/**
+ * Present a window of an exported buffer as the next block of input.
+ * 
+ * No data is copied; the view refers directly to the memory of the buffer.
+ * 
+ * @param src a pointer to the Py_buffer holding the complete input.
+ * @param offset the position of the block within the input.
+ * @param max_length the maximum number of bytes in the block.
+ * @param view a pointer to the view to populate with the block.
+ * @return true on success; false otherwise.
+ */
+static int input_from_buffer(void *const src, const size_t offset, const size_t max_length,
+        Py_buffer *view) {
+    const Py_buffer *const buffer = (const Py_buffer *) src;
+    const size_t start = xd3_min(offset, (size_t) buffer->len);
+    const size_t length = xd3_min(max_length, (size_t) buffer->len - start);
+    return PyBuffer_FillInfo(view, NULL, (char *) buffer->buf + start, (Py_ssize_t) length, 1,
+            PyBUF_SIMPLE) == 0;
+}
+
+
+/**
+ * Present the next part of the content given to encode_step or decode_step as
+ * the next block of input.
+ * 
+ * The position is kept by the stream, as the content may be passed to the
+ * engine over several calls.
+ * 
+ * @param src a pointer to the stream instance holding the content.
+ * @param offset unused.
+ * @param max_length the maximum number of bytes in the block.
+ * @param view a pointer to the view to populate with the block, which is empty
+ *             if there is no content left.
+ * @return true on success; false otherwise.
+ */
+static int input_from_pending(void *const src, const size_t offset, const size_t max_length,
+        Py_buffer *view) {
+    xd3py_stream *const self = (xd3py_stream *) src;
+    (void) offset;
+    
+    if (!self->pending_held)
+        return PyBuffer_FillInfo(view, NULL, NULL, 0, 1, PyBUF_SIMPLE) == 0;
+    if (!input_from_buffer(&self->pending, (size_t) self->pending_offset, max_length, view))
+        return 0;
+    self->pending_offset += view->len;
+    return 1;
 }
 
 
-static int write_to_file(PyObject **dest, const char *const src, const size_t len) {
-    PyObject *const result = PyObject_CallMethod(*dest, "write", "s#", src, len);
+static int write_to_file(void *const dest, const char *const src, const size_t len) {
+    PyObject *const result = PyObject_CallMethod(*(PyObject **) dest, "write", "s#", src, len);
     if (result == NULL)
         return 0;
     Py_DECREF(result);
@@ -417,7 +2271,8 @@ static int write_to_file(PyObject **dest, const char *const src, const size_t le
 }
 
 
-static int write_to_string(PyObject **dest, const char *const src, const size_t len) {
+static int write_to_string(void *const str, const char *const src, const size_t len) {
+    PyObject **const dest = (PyObject **) str;
     const Py_ssize_t pos = PyString_GET_SIZE(*dest);
     // Cannot resize an empty string as it is shared.
     if (pos == 0) {
@@ -431,62 +2286,543 @@ static int write_to_string(PyObject **dest, const char *const src, const size_t
 }
 
 
-static int do_processing(xd3_stream *const stream, PyObject *const src, PyObject **dest,
-        const Py_ssize_t wanted, input_func input, processing_func process, output_func output,
-        buffer_t **buffer) {
-    PyObject *data = NULL;
-    Py_ssize_t read = 0;
+/**
+ * Record the location of output in the engine's buffer instead of copying it.
+ * The output remains valid until the engine next runs.
+ */
+static int write_to_view(void *const dest, const char *const src, const size_t len) {
+    xd3py_window_iter *const iter = (xd3py_window_iter *) dest;
+    iter->data = src;
+    iter->length = len;
+    return 1;
+}
+
+
+static int write_to_buffer(void *const dest, const char *const src, const size_t len) {
+    output_buffer *const output = (output_buffer *) dest;
+    // do_processing never produces more than was requested, so the data
+    // always fits.
+    memcpy((char *) output->view.buf + output->position, src, len);
+    output->position += len;
+    return 1;
+}
+
+
+/**
+ * Drive the engine until the input is exhausted or the wanted number of bytes
+ * has been output.
+ * 
+ * When the wanted number of bytes is reached part way through an output
+ * window, processing pauses: the rest of the window stays in the engine's
+ * output buffer, and the input it is decoding is retained by the stream, until
+ * the next call resumes from that point. Processing pauses in the same way
+ * when the engine requests a source block that the caller is to supply.
+ * 
+ * @param self a pointer to the stream instance being processed.
+ * @param src a pointer to the input, interpreted by the input function.
+ * @param dest a pointer to the destination, interpreted by the output
+ *             function.
+ * @param wanted the maximum number of bytes to output, or -1 for no limit.
+ * @param input the function used to obtain each block of input.
+ * @param process the engine function; xd3_encode_input or xd3_decode_input.
+ * @param output the function used to store output.
+ * @return true on success; false, with an exception set, otherwise.
+ */
+static int do_processing(xd3py_stream *const self, void *const src, void *const dest,
+        const Py_ssize_t wanted, input_func input, processing_func process, output_func output) {
+    xd3_stream *const stream = &self->stream;
+    Py_buffer data = {NULL};
+    int have_input = 0;
     size_t remaining = (wanted >= 0) ? wanted : PY_SSIZE_T_MAX;
     int ret = 0;
     size_t total_read = 0;
     const usize_t window_len = stream->winsize;
+    // While a source block is awaited the decoder's output holds a partly
+    // decoded window, which must not be consumed until the engine resumes.
+    int output_ready = !self->block_wanted;
     
-    do {
-        Py_ssize_t available;
-        char *bytes;
-        if (((data = input(src, total_read, window_len)) == NULL)
-                || (PyString_AsStringAndSize(data, &bytes, &read) == -1))
-            goto exit;
-        total_read += read;
-        xd3_avail_input(stream, (uint8_t *) bytes, (usize_t) read);
+    self->block_wanted = 0;
+    if (self->input_held) {
+        data = self->input;
+        have_input = 1;
+        self->input_held = 0;
+    }
+    
+    for (;;) {
+        if (output_ready && (stream->avail_out > 0)) {
+            const usize_t available = xd3_min(stream->avail_out - self->output_offset, remaining);
+            const int first_pause = (self->output_offset == 0) && (available > 0);
+            if (available > 0) {
+                const double start = monotonic_time();
+                const int written = output(dest, (char *) stream->next_out + self->output_offset,
+                        available);
+                self->stats.output_time += monotonic_time() - start;
+                if (!written)
+                    goto exit;
+                self->stats.bytes_out += available;
+            }
+            remaining -= available;
+            self->output_offset += available;
+            if (self->output_offset < stream->avail_out) {
+                // Only count what is held back from a window the first time.
+                if (first_pause)
+                    self->stats.spill_bytes += stream->avail_out - self->output_offset;
+                break;
+            }
+            self->output_offset = 0;
+            xd3_consume_output(stream);
+            // Output recorded in place must be used before the engine runs
+            // again, so it is returned a window at a time.
+            if (output == write_to_view)
+                break;
+        }
+        if (remaining == 0)
+            break;
+        
+        if (!have_input) {
+            const double start = monotonic_time();
+            const int obtained = input(src, total_read, window_len, &data);
+            self->stats.input_time += monotonic_time() - start;
+            if (!obtained)
+                goto exit;
+            have_input = 1;
+            total_read += data.len;
+            self->stats.bytes_in += data.len;
+            // The engine uses a NULL input pointer to detect that no input has
+            // ever been provided, so empty buffers must still be non-NULL.
+            xd3_avail_input(stream, (data.buf != NULL) ? (uint8_t *) data.buf : (uint8_t *) "",
+                    (usize_t) data.len);
+        }
         
-repeat_processing:
-        switch(process(stream)) {
+        output_ready = 1;
+        switch(run_engine(stream, process)) {
             case XD3_INPUT:
-                Py_CLEAR(data);
+                have_input = 0;
+                PyBuffer_Release(&data);
+                if (data.len < window_len)
+                    goto done;
                 continue;
-            case XD3_OUTPUT:
-                available = min(stream->avail_out, remaining);
-                if (!output(dest, (char *) stream->next_out, available))
+            case XD3_WINFINISH:
+                self->stats.windows++;
+                if (self->indexed && (process == xd3_encode_input) && !record_window(self))
                     goto exit;
-                remaining -= available;
-                if (available != stream->avail_out)
-                    buffer_append(buffer, (char *) stream->next_out + available,
-                            (ulong) (stream->avail_out - available));
-                xd3_consume_output(stream);
+                continue;
+            case XD3_OUTPUT:
                 /* Fall through */
             case XD3_WINSTART:
                 /* Fall through */
-            case XD3_WINFINISH:
-                /* Fall through */
             case XD3_GOTHEADER:
-                goto repeat_processing;
+                continue;
+            case XD3_GETSRCBLK:
+                // Only returned when the caller is to supply source blocks.
+                self->block_wanted = 1;
+                goto pause;
             case ENOMEM:
                 PyErr_NoMemory();
                 goto exit;
             default:
-                PyErr_SetString(PyExc_IOError, stream->msg);
+                // Keep any more specific error raised by a callback.
+                if (!PyErr_Occurred())
+                    PyErr_SetString(PyExc_IOError, xd3_errstring(stream));
                 goto exit;
         }
-    } while ((read == window_len) && (remaining != 0));
+    }
+    
+pause:
+    if (have_input) {
+        self->input = data;
+        self->input_held = 1;
+        have_input = 0;
+    }
+done:
     ret = 1;
     
 exit:
-    Py_XDECREF(data);
+    if (have_input)
+        PyBuffer_Release(&data);
+    return ret;
+}
+
+
+/**
+ * Add the window just encoded to the index of the stream.
+ * 
+ * @param self a pointer to the stream instance being encoded.
+ * @return true on success; false, with an exception set, otherwise.
+ */
+static int record_window(xd3py_stream *const self) {
+    xd3_stream *const stream = &self->stream;
+    window_entry_t entry = {0};
+
+    if (self->windows.count > 0) {
+        const window_entry_t *const last = &self->windows.windows[self->windows.count - 1];
+        entry.target_offset = last->target_offset + last->target_length;
+    }
+    entry.target_length = (usize_t) (stream->total_in - entry.target_offset);
+    // Every window ends where the engine's output ends, less any indices
+    // written since the previous window.
+    entry.delta_offset = (self->windows.count > 0) ? self->windows_end
+            : indexed_header_size(stream);
+    if (xd3_encoder_used_source(stream)) {
+        entry.source_offset = xd3_encoder_srcbase(stream);
+        entry.source_length = xd3_encoder_srclen(stream);
+    }
+    if (window_index_append(&self->windows, &entry) != 0) {
+        PyErr_NoMemory();
+        return 0;
+    }
+    self->windows_end = stream->total_out + self->index_bytes;
+    return 1;
+}
+
+
+/**
+ * Append an index of the windows encoded so far to the output and, if the
+ * target is seekable, update the application header to locate it.
+ * 
+ * Nothing is written if no windows have been encoded since the last index.
+ * Otherwise the index is complete, so that only the last one need be read,
+ * and repeats every entry of the previous one.
+ * 
+ * @param self a pointer to the stream instance being encoded.
+ * @param output the function used to store the index.
+ * @param dest a pointer to the destination, interpreted by the output
+ *             function.
+ * @return true on success; false, with an exception set, otherwise.
+ */
+static int write_index(xd3py_stream *const self, output_func output, void *const dest) {
+    const xoff_t offset = self->windows_end;
+    const usize_t locator_size = WINDOW_INDEX_APPHEADER_SIZE - WINDOW_INDEX_LOCATOR_OFFSET;
+    PyObject *position;
+    PyObject *result;
+    uint8_t *window;
+    usize_t size;
+    int ret;
+
+    if (self->windows.count == self->windows_indexed)
+        return 1;
+    if (window_index_encode(&self->windows, &window, &size) != 0) {
+        PyErr_NoMemory();
+        return 0;
+    }
+    ret = output(dest, (const char *) window, size);
+    free(window);
+    if (!ret)
+        return 0;
+    self->windows_indexed = self->windows.count;
+    self->index_bytes += size;
+    self->windows_end += size;
+    if (self->target_origin < 0)
+        return 1;
+
+    if ((position = PyObject_CallMethod(self->target, "tell", NULL)) == NULL)
+        return 0;
+    window_index_appheader(self->appheader, offset);
+    result = PyObject_CallMethod(self->target, "seek", "L", self->target_origin
+            + (PY_LONG_LONG) (indexed_header_size(&self->stream) - locator_size));
+    ret = (result != NULL)
+            && write_to_file(&self->target, (const char *) self->appheader
+                    + WINDOW_INDEX_LOCATOR_OFFSET, locator_size);
+    Py_XDECREF(result);
+    if ((result = PyObject_CallMethod(self->target, "seek", "O", position)) == NULL)
+        ret = 0;
+    Py_XDECREF(result);
+    Py_DECREF(position);
+    return ret;
+}
+
+
+/**
+ * Return the size of the file header written by an encoder whose application
+ * header locates an index: the magic number and version, the header
+ * indicator, the secondary compressor ID if any, and the application header
+ * preceded by its one byte length.
+ */
+static xoff_t indexed_header_size(const xd3_stream *const stream) {
+    return 5 + ((stream->sec_type != NULL) ? 1 : 0) + 1 + WINDOW_INDEX_APPHEADER_SIZE;
+}
+
+
+/**
+ * Initialise an engine configuration from the tuning arguments of a stream.
+ * 
+ * @param config a pointer to the configuration to initialise.
+ * @param level the compression level, from 0 to 9.
+ * @param matcher the name of a string matcher preset, or NULL to choose one to
+ *                suit the level.
+ * @param secondary the name of the secondary compressor.
+ * @param winsize the encoder window size.
+ * @return true on success; false, with an exception set, if any argument is
+ *         invalid.
+ */
+static int configure_stream(xd3_config *const config, const int level, const char *matcher,
+        const char *secondary, const Py_ssize_t winsize) {
+    int flags = XD3_ADLER32;
+    const matcher_preset *preset;
+
+    if ((level < 0) || (level > 9)) {
+        PyErr_SetString(PyExc_ValueError, "level must be between 0 and 9");
+        return 0;
+    }
+    if ((winsize < XD3_ALLOCSIZE) || ((size_t) winsize > UINT32_MAX)) {
+        PyErr_Format(PyExc_ValueError, "winsize must be between %u and %u",
+                (unsigned) XD3_ALLOCSIZE, (unsigned) UINT32_MAX);
+        return 0;
+    }
+    // Match the presets chosen by the xdelta3 command for each level.
+    if (matcher == NULL)
+        matcher = (level <= 1) ? "fastest" : (level == 2) ? "faster" : (level <= 5) ? "fast"
+                : (level == 6) ? "default" : "slow";
+    for (preset = matcher_presets; preset->name != NULL; preset++)
+        if (strcmp(preset->name, matcher) == 0)
+            break;
+    if (preset->name == NULL) {
+        PyErr_Format(PyExc_ValueError, "unknown matcher: %s", matcher);
+        return 0;
+    }
+
+    if (level == 0)
+        flags |= XD3_NOCOMPRESS;
+    else
+        flags |= level << XD3_COMPLEVEL_SHIFT;
+    if (strcmp(secondary, "djw") == 0)
+        flags |= XD3_SEC_DJW;
+    else if (strcmp(secondary, "fgk") == 0)
+        flags |= XD3_SEC_FGK;
+    else if (strcmp(secondary, "none") != 0) {
+        PyErr_Format(PyExc_ValueError, "unknown secondary compressor: %s", secondary);
+        return 0;
+    }
+
+    xd3_init_config(config, flags);
+    config->sec_data.ngroups = 0;
+    config->sec_inst.ngroups = 1;
+    config->sec_addr.ngroups = 1;
+    config->smatch_cfg = preset->config;
+    config->iopt_size = XD3_DEFAULT_IOPT_SIZE;
+    config->winsize = (usize_t) winsize;
+    return 1;
+}
+
+
+/**
+ * Shrink the encoder window to suit an input of the given length, as
+ * xd3_encode_memory does, so that small inputs do not allocate full-sized
+ * windows and tables.
+ * 
+ * @param config a pointer to the configuration to adjust.
+ * @param length the length of the input to be encoded.
+ */
+static void fit_window(xd3_config *const config, const Py_ssize_t length) {
+    config->winsize = xd3_max(xd3_min((usize_t) length, config->winsize), XD3_ALLOCSIZE);
+    config->sprevsz = xd3_min(round_up_pow2(config->winsize), XD3_DEFAULT_SPREVSZ);
+}
+
+
+/**
+ * Estimate the space needed to encode an input of the given length in memory.
+ * VCDIFF rarely expands its input by much, so this is usually enough; if not,
+ * encoding is repeated with more space.
+ */
+static usize_t encode_capacity(const Py_ssize_t length) {
+    return (usize_t) xd3_min((xoff_t) length + length / 8 + 1024, UINT32_MAX);
+}
+
+
+/**
+ * Estimate the space needed to decode a delta in memory. The decoded size is
+ * not known in advance, so this is a generous guess; if it is insufficient,
+ * decoding is repeated with more space.
+ */
+static usize_t decode_capacity(const Py_ssize_t delta_length, const Py_ssize_t source_length) {
+    return (usize_t) xd3_min((xoff_t) source_length + delta_length * 4 + XD3_ALLOCSIZE,
+            UINT32_MAX);
+}
+
+
+static ulong round_up_pow2(ulong value) {
+    ulong result = 1;
+    while (result < value)
+        result <<= 1;
+    return result;
+}
+
+
+/**
+ * Choose the size of the source blocks of a stream.
+ * 
+ * Blocks are normally source_winsize / cache_blocks bytes. If the source is
+ * known to be smaller than source_winsize, they are shrunk so that the whole
+ * source still fits in the cache without each block being mostly unused.
+ * 
+ * @param self a pointer to the stream instance.
+ * @param source_size the size of the source; zero (0) or less if unknown.
+ * @return the block size, a power of two no smaller than XD3_ALLOCSIZE.
+ */
+static ulong choose_block_size(const xd3py_stream *const self, const PY_LONG_LONG source_size) {
+    ulong size = self->source_winsize / self->cache_blocks;
+    if ((source_size > 0) && ((unsigned PY_LONG_LONG) source_size < self->source_winsize))
+        size = (ulong) ((source_size + self->cache_blocks - 1) / self->cache_blocks);
+    return round_up_pow2(xd3_max(size, (ulong) XD3_ALLOCSIZE));
+}
+
+
+/**
+ * Obtain a read-only view of the data passed to Stream.write.
+ * 
+ * Objects exporting the buffer protocol are used in place. Objects that only
+ * support the old-style buffer interface, such as mmap, are copied: the engine
+ * reads the data with the GIL released, and nothing would stop such an object
+ * from releasing its memory meanwhile. Unicode objects and anything else are
+ * coerced to a string first, as they were before buffers were supported.
+ * 
+ * @param object a pointer to the content object, which may be NULL or None.
+ * @param view a pointer to the view to populate. Ownership is passed to the
+ *             caller, who must release it with PyBuffer_Release.
+ * @return true on success; false otherwise.
+ */
+static int get_content_buffer(PyObject *object, Py_buffer *view) {
+    PyObject *string;
+    int ret;
+
+    if ((object == NULL) || (object == Py_None))
+        return PyBuffer_FillInfo(view, NULL, "", 0, 1, PyBUF_SIMPLE) == 0;
+    if (!PyUnicode_Check(object) && PyObject_CheckBuffer(object))
+        return PyObject_GetBuffer(object, view, PyBUF_SIMPLE) == 0;
+    if (!PyUnicode_Check(object) && PyObject_CheckReadBuffer(object)) {
+        const void *data;
+        Py_ssize_t length;
+        if (PyObject_AsReadBuffer(object, &data, &length) == -1)
+            return 0;
+        string = PyString_FromStringAndSize((const char *) data, length);
+    } else
+        string = PyObject_Str(object);
+    if (string == NULL)
+        return 0;
+    ret = PyObject_GetBuffer(string, view, PyBUF_SIMPLE) == 0;
+    Py_DECREF(string);
+    return ret;
+}
+
+
+/**
+ * Obtain a writable view of the buffer passed to Stream.readinto.
+ * 
+ * As with get_content_buffer, objects that only support the old-style buffer
+ * interface, such as mmap, are accepted.
+ * 
+ * @param object a pointer to the buffer object.
+ * @param view a pointer to the view to populate. Ownership is passed to the
+ *             caller, who must release it with PyBuffer_Release.
+ * @return true on success; false otherwise.
+ */
+static int get_writable_buffer(PyObject *object, Py_buffer *view) {
+    void *data;
+    Py_ssize_t length;
+
+    if (PyObject_CheckBuffer(object))
+        return PyObject_GetBuffer(object, view, PyBUF_WRITABLE) == 0;
+    if (PyObject_AsWriteBuffer(object, &data, &length) == -1)
+        return 0;
+    return PyBuffer_FillInfo(view, object, data, length, 0, PyBUF_WRITABLE) == 0;
+}
+
+
+/**
+ * Run a step of the engine with the GIL released.
+ * 
+ * Callbacks made by the engine that need the interpreter must bracket their
+ * use of it with acquire_gil and release_gil.
+ * 
+ * @param stream a pointer to the engine stream; its opaque field refers to the
+ *               owning stream object.
+ * @param process the engine function to run.
+ * @return the result of the engine function.
+ */
+static int run_engine(xd3_stream *const stream, processing_func process) {
+    xd3py_stream *const self = (xd3py_stream *) stream->opaque;
+    const double source_time = self->stats.source_time;
+    const double start = monotonic_time();
+    int ret;
+    
+    release_gil(self);
+    ret = process(stream);
+    acquire_gil(self);
+    // Source blocks are fetched from within the engine; that time is
+    // accounted for separately.
+    self->stats.engine_time += (monotonic_time() - start) - (self->stats.source_time - source_time);
     return ret;
 }
 
 
+/**
+ * Return the time elapsed since some unspecified point, in seconds, from a
+ * clock that is not affected by changes to the system time.
+ */
+static double monotonic_time(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+    if (frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    return (double) now.QuadPart / (double) frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+#endif
+}
+
+
+/**
+ * Re-acquire the GIL if it was released by run_engine.
+ * 
+ * @param self a pointer to the stream instance being processed.
+ * @return true if the GIL was re-acquired by this call and should be released
+ *         again with release_gil; false if it was already held.
+ */
+static int acquire_gil(xd3py_stream *const self) {
+    PyThreadState *const state = self->thread_state;
+    if (state == NULL)
+        return 0;
+    self->thread_state = NULL;
+    PyEval_RestoreThread(state);
+    return 1;
+}
+
+
+static void release_gil(xd3py_stream *const self) {
+    if (self->thread_state == NULL)
+        self->thread_state = PyEval_SaveThread();
+}
+
+
+/**
+ * Mark the stream as being in use by the current thread.
+ * 
+ * As the GIL is released during processing, another thread could otherwise
+ * enter the same engine state concurrently.
+ * 
+ * @param self a pointer to the stream instance about to be used.
+ * @return true if the stream was claimed; false, with an exception set, if it
+ *         is already in use or a view of its output is still exported.
+ */
+static int enter_stream(xd3py_stream *const self) {
+    if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "Stream is in use by another thread");
+        return 0;
+    }
+    if (self->window_exports > 0) {
+        PyErr_SetString(PyExc_BufferError,
+                "Stream cannot be used while a window from iter_windows is exported");
+        return 0;
+    }
+    self->busy = 1;
+    return 1;
+}
+
+
 static int file_object_check(PyObject *object) {
     if (!is_callable(object, "read") || !is_callable(object, "write")) {
         PyErr_SetString(PyExc_TypeError, "object must be file-like");
@@ -517,8 +2853,23 @@ static int is_callable(PyObject *object, const char *attr) {
 
 
 PyMODINIT_FUNC init_xdelta(void) {
+    PyObject *io;
     PyObject *module;
-    if (PyType_Ready(&stream_type) < 0)
+    // The GIL is released while encoding and decoding.
+    PyEval_InitThreads();
+    // Engines may run on several threads, so the match kernels are chosen
+    // before any of them start.
+    match_kernel_init();
+    if ((PyType_Ready(&stream_type) < 0) || (PyType_Ready(&window_iter_type) < 0))
+        return;
+
+    if ((io = PyImport_ImportModule("io")) != NULL) {
+        native_file_types = Py_BuildValue("(NNN)", PyObject_GetAttrString(io, "FileIO"),
+                PyObject_GetAttrString(io, "BufferedReader"),
+                PyObject_GetAttrString(io, "BufferedRandom"));
+        Py_DECREF(io);
+    }
+    if (native_file_types == NULL)
         return;
 
     module = Py_InitModule3(MODULE_NAME, module_functions,
@@ -15,24 +15,147 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <Python.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 
 #include "xdelta3.h"
-#include "buffer.h"
 #include "lru_cache.h"
+#include "shared_cache.h"
+#include "source_reader.h"
+#include "thread_pool.h"
+#include "window_index.h"
+#include "delta_merge.h"
+#include "compressed_cache.h"
+#include "match_kernel.h"
+
+
+/* Performance counters reported by Stream.stats. Times are in seconds. */
+typedef struct {
+    /* Time spent in the engine itself, excluding source block fetches. */
+    double engine_time;
+    /* Time spent reading input, writing output and fetching source blocks
+     * that were not in the cache. */
+    double input_time;
+    double output_time;
+    double source_time;
+    ulong cache_hits;
+    ulong cache_misses;
+    /* Misses restored from the compressed cache rather than fetched. */
+    ulong compressed_hits;
+    ulong blocks_read;
+    PY_LONG_LONG bytes_in;
+    PY_LONG_LONG bytes_out;
+    /* Output left in the engine after a read was satisfied, to be returned by
+     * later reads. */
+    PY_LONG_LONG spill_bytes;
+    ulong windows;
+} stream_stats;
 
 
 typedef struct {
     PyObject_HEAD
     PyObject *target;
     
-    buffer_t *buffer;
     lru_cache_t *cache;
+    /* The source in the process-wide shared cache, used instead of the cache
+     * above when the content of the source can be identified; NULL
+     * otherwise. The block the engine is using is held until it asks for
+     * another. */
+    shared_cache_source_t *shared;
+    const lru_cache_entry_t *held_block;
+    /* The key given by the caller to identify the content of the source;
+     * NULL if none was given. */
+    PyObject *source_key;
+    /* Reads source blocks natively when the source is a real file; NULL if
+     * the source is read through its read method. */
+    source_reader_t *reader;
+    /* The size of each source block and the number of blocks cached. Blocks
+     * are shrunk to suit a source known to be smaller than source_winsize,
+     * the most the cache may hold. */
+    ulong block_size;
+    ulong cache_blocks;
+    ulong source_winsize;
+    lru_cache_policy cache_policy;
+    /* Blocks evicted from the cache above are kept here, compressed, if a
+     * capacity was given; NULL otherwise. */
+    compressed_cache_t *compressed;
+    ulong compressed_capacity;
+    /* For sources read through their methods: the block at the current file
+     * position, and the position of block zero if the source is seekable or
+     * -1 if it can only be read forwards. */
+    ulong source_block;
+    PY_LONG_LONG source_origin;
     
     xd3_stream  stream;
     xd3_source *source;
+    
+    /* Input held by the decoder while a read is paused part way through a
+     * window. It must remain valid until the engine next asks for input. */
+    Py_buffer input;
+    int       input_held;
+    /* The number of bytes of the engine's current output (next_out) that
+     * have already been returned to the caller. */
+    usize_t   output_offset;
+    
+    /* The state of the calling thread while the GIL is released around the
+     * engine; NULL whenever the GIL is held. */
+    PyThreadState *thread_state;
+    /* Set while a read or write is being processed so that other threads
+     * cannot re-enter the engine once the GIL has been released. */
+    int busy;
+    
+    stream_stats stats;
+    
+    /* Set if an index of the encoded windows is embedded in the output. The
+     * application header locates the most recent index, which is written at
+     * each flush. */
+    int indexed;
+    uint8_t appheader[WINDOW_INDEX_APPHEADER_SIZE];
+    window_index_t windows;
+    /* The number of windows in the most recent index; the total size of the
+     * indices written so far, which the engine does not count as output; the
+     * offset at which the next window or index will be written; and the
+     * position of the delta within the target if the target is seekable, or
+     * -1 otherwise. */
+    ulong windows_indexed;
+    xoff_t index_bytes;
+    xoff_t windows_end;
+    PY_LONG_LONG target_origin;
+    
+    /* Input given to encode_step or decode_step that has not yet been passed
+     * to the engine, and the position within it of the next byte to pass. */
+    Py_buffer pending;
+    int       pending_held;
+    Py_ssize_t pending_offset;
+    /* Set while encode_step or decode_step is processing, so that source
+     * blocks missing from the cache are requested from the caller rather than
+     * read from the source; and set when processing paused because a block was
+     * requested. */
+    int deferred_source;
+    int block_wanted;
+    /* Set while a flush requested by encode_step is incomplete. */
+    int flushing;
+    /* The number of views exported by window iterators, which refer to the
+     * engine's output buffer. The engine may reallocate that buffer, so the
+     * stream cannot be used while any remain. */
+    Py_ssize_t window_exports;
 } xd3py_stream;
 
 
+/* An iterator over the decoded windows of a stream, returned by
+ * Stream.iter_windows. */
+typedef struct {
+    PyObject_HEAD
+    xd3py_stream *stream;
+    /* The output of the current window, within the engine's buffer. */
+    const char *data;
+    size_t length;
+} xd3py_window_iter;
+
+
 PyMODINIT_FUNC init_xdelta(void);
 
 #endif	/* DELTAMODULE_H */
@@ -1,283 +1,503 @@
 #include "lru_cache.h"
 #include <assert.h>
 
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/* Marks an unused slot in a hash index. */
+#define EMPTY_SLOT ((ulong) -1)
+
+#if HAVE_PTHREAD
+#define LOCK_BUDGET() pthread_mutex_lock(&budget_lock)
+#define UNLOCK_BUDGET() pthread_mutex_unlock(&budget_lock)
+#else
+#define LOCK_BUDGET()
+#define UNLOCK_BUDGET()
+#endif
+
+/* The queues in which a block may be found. Under the LRU policy, every
+ * block is in the main queue. Under 2Q, new blocks enter the FIFO queue, and
+ * the identifiers of blocks replaced from there are remembered as ghosts.
+ */
+enum {MAIN_QUEUE, FIFO_QUEUE, GHOST, VACANT};
+
 typedef struct blk {
     lru_cache_entry_t payload;
     struct blk *next;
     struct blk *previous;
+    int queue;
 } block;
 
-struct lru_cache {
-    block *blocks;
+/* An open-addressed hash index, resolving collisions by linear probing. Each
+ * slot holds the position of a node, or EMPTY_SLOT.
+ */
+typedef struct {
+    block *nodes;
+    ulong *slots;
+    ulong mask;
+} hash_index;
+
+/* A list of blocks, ordered from most to least recently added or used. */
+typedef struct {
     block *head;
     block *tail;
+    ulong count;
+} queue;
+
+struct lru_cache {
+    block *blocks;
+    hash_index index;
+    queue queues[2];
+    lru_cache_policy policy;
+    lru_cache_evict_func evict;
+    void *evict_context;
+    /* Allocated blocks whose entries were removed, to be used before any
+     * other block is allocated or replaced. */
+    block *vacant;
+    /* For 2Q: the size of the FIFO queue, and a ring of ghosts, replaced
+     * oldest first. */
+    ulong max_fifo;
+    block *ghosts;
+    hash_index ghost_index;
+    ulong max_ghosts;
+    ulong next_ghost;
     ulong cur_blocks;
     ulong max_blocks;
     ulong block_size;
 };
 
-static long find_block(const lru_cache_t *const cache, const ulong id);
+/* The memory budget shared by all caches, and the amount allocated from it.
+ * Caches are used by streams running outside the interpreter lock, so both
+ * are guarded by a lock where threads are available.
+ */
+static ulong budget = 0;
+static ulong allocated = 0;
+#if HAVE_PTHREAD
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static char *allocate_block(const ulong size, const int force);
+static int init_index(hash_index *const index, block *const nodes, const ulong nodes_count);
+static ulong home_slot(const hash_index *const index, const ulong id);
+static ulong find_slot(const hash_index *const index, const ulong id);
+static void remove_slot(hash_index *const index, ulong slot);
+static block *choose_victim(const lru_cache_t *const cache);
+static void add_ghost(lru_cache_t *const cache, const ulong id);
+static int take_ghost(lru_cache_t *const cache, const ulong id);
+static void unlink_block(lru_cache_t *const cache, block *const blk);
+static void push_block(lru_cache_t *const cache, block *const blk, const int which);
 
 
-lru_cache_t *lru_cache_init(const ulong blocks, const ulong block_size) {
-    lru_cache_t *cache = malloc(sizeof *cache);
+lru_cache_t *lru_cache_init(const ulong blocks, const ulong block_size,
+                            const lru_cache_policy policy) {
+    lru_cache_t *cache = calloc(1, sizeof *cache);
     assert(blocks != 0);
     assert(block_size != 0);
     
     if (cache != NULL) {
-        char *data = malloc(blocks * block_size);
+        ulong i;
+        cache->policy = policy;
         cache->block_size = block_size;
+        cache->max_blocks = blocks;
+        cache->max_fifo = (blocks + 3) / 4;
+        cache->max_ghosts = (policy == LRU_CACHE_2Q) ? (blocks + 1) / 2 : 0;
         cache->blocks = malloc(blocks * sizeof(block));
+        if (cache->max_ghosts > 0)
+            cache->ghosts = malloc(cache->max_ghosts * sizeof(block));
         
-        if ((data != NULL) && (cache->blocks != NULL)) {
-            ulong i;
-            for (i = 0; i < blocks; i++) {
-                cache->blocks[i].payload.id = 0;
-                cache->blocks[i].payload.data = data;
-                cache->blocks[i].payload.size = 0;
-                cache->blocks[i].next = NULL;
-                cache->blocks[i].previous = NULL;
-                data += block_size;
-            }
-            cache->head = NULL;
-            cache->tail = NULL;
-            cache->cur_blocks = 0;
-            cache->max_blocks = blocks;
-        } else {
-            // As data will be the larger allocation, it's possible for it to
-            // fail but for the block array allocation to succeed so free both.
-            if (data != NULL)
-                free(data);
-            if (cache->blocks != NULL)
-                free(cache->blocks);
+        if ((cache->blocks == NULL) || ((cache->max_ghosts > 0) && (cache->ghosts == NULL))
+                || !init_index(&cache->index, cache->blocks, blocks)
+                || ((cache->max_ghosts > 0)
+                    && !init_index(&cache->ghost_index, cache->ghosts, cache->max_ghosts))) {
+            free(cache->blocks);
+            free(cache->ghosts);
+            free(cache->index.slots);
+            free(cache->ghost_index.slots);
             free(cache);
-            cache = NULL;
+            return NULL;
         }
+        for (i = 0; i < blocks; i++) {
+            cache->blocks[i].payload.id = 0;
+            cache->blocks[i].payload.data = NULL;
+            cache->blocks[i].payload.size = 0;
+            cache->blocks[i].next = NULL;
+            cache->blocks[i].previous = NULL;
+            cache->blocks[i].queue = VACANT;
+        }
+        for (i = 0; i < cache->max_ghosts; i++)
+            cache->ghosts[i].queue = VACANT;
     }
     return cache;
 }
 
 
+void lru_cache_on_evict(lru_cache_t *const cache, lru_cache_evict_func func,
+                        void *const context) {
+    cache->evict = func;
+    cache->evict_context = context;
+}
+
+
 void lru_cache_free(lru_cache_t *const cache) {
-    char *data;
     ulong i;
     if (cache == NULL)
         return;
 
-    // Find the start of the data region. As the blocks may have changed order,
-    // this may no longer be the first block in the array.
-    data = cache->blocks[0].payload.data;
-    for (i = 1; i < cache->cur_blocks; i++)
-        if(cache->blocks[i].payload.data < data)
-            data = cache->blocks[i].payload.data;
-
-    free(data);
+    for (i = 0; i < cache->cur_blocks; i++)
+        free(cache->blocks[i].payload.data);
+    lru_cache_unreserve(cache->cur_blocks * cache->block_size);
     free(cache->blocks);
+    free(cache->ghosts);
+    free(cache->index.slots);
+    free(cache->ghost_index.slots);
     free(cache);
 }
 
 
 const lru_cache_entry_t *lru_cache_get(lru_cache_t *const cache, const ulong id) {
-    const long i = find_block(cache, id);
-    block *block;
-    if (i < 0)
+    const ulong slot = find_slot(&cache->index, id);
+    block *blk;
+    if (cache->index.slots[slot] == EMPTY_SLOT)
         return NULL;
     
-    block = &cache->blocks[i];
-    if (block != cache->head) {
-        // Remove the block from its current location in the last used list...
-        if (block->previous != NULL)
-            block->previous->next = block->next;
-        if (block->next != NULL)
-            block->next->previous = block->previous;
-        // ...reassigning the list tail if necessary...
-        if (block == cache->tail)
-            cache->tail = block->previous;
-        // ...and move it to the head of the list.
-        block->previous = NULL;
-        block->next = cache->head;
-        cache->head->previous = block;
-        cache->head = block;
+    // Blocks in the FIFO queue keep their place, so that a burst of requests
+    // for a block does not make it seem popular.
+    blk = &cache->blocks[cache->index.slots[slot]];
+    if ((blk->queue == MAIN_QUEUE) && (blk != cache->queues[MAIN_QUEUE].head)) {
+        unlink_block(cache, blk);
+        push_block(cache, blk, MAIN_QUEUE);
     }
-    return &block->payload;
+    return &blk->payload;
 }
 
 
 const lru_cache_entry_t *lru_cache_put(lru_cache_t *const cache, const ulong id, const char *data,
                                        const ulong length) {
-    long i = find_block(cache, id);
-    block *blk;
+    lru_cache_entry_t *entry;
     assert((data != NULL) || (length == 0));
     assert(length <= cache->block_size);
     
-    if (i < 0) {
-        i = -(i + 1);
-        if (i == cache->max_blocks)
-            i = cache->max_blocks - 1;
-        blk = &cache->blocks[i];
-        
-        if (cache->cur_blocks == cache->max_blocks) {
-            ptrdiff_t j = cache->tail - blk + i;
-            const int dir = (cache->tail < blk) ? 1 : -1;
-            char *stale_data = cache->tail->payload.data;
-            cache->tail->previous->next = NULL;
-            cache->tail = cache->tail->previous;
-            while (j < i) {
-                // Shift block...
-                cache->blocks[j] = cache->blocks[j + dir];
-                // ...and adjust list pointers.
-                if (cache->blocks[j].previous != NULL)
-                    cache->blocks[j].previous->next = &cache->blocks[j];
-                if (cache->blocks[j].next != NULL)
-                    cache->blocks[j].next->previous = &cache->blocks[j];
-                if (cache->head == &cache->blocks[j + dir])
-                    cache->head = &cache->blocks[j];
-                if (cache->tail == &cache->blocks[j + dir])
-                    cache->tail = &cache->blocks[j];
-                j += dir;
-            }
-            blk->payload.data = stale_data;
-            blk->next = cache->head;
-            blk->previous = NULL;
-            cache->head->previous = blk;
-        } else {
-            if (cache->cur_blocks > 0) {
-                block *new_block = &cache->blocks[cache->cur_blocks];
-                ptrdiff_t j = new_block - blk + i;
-                char *stale_data = new_block->payload.data;
-                while (j > i) {
-                    // Shift block...
-                    cache->blocks[j] = cache->blocks[j - 1];
-                    // ...and adjust list pointers.
-                    if (cache->blocks[j].previous != NULL)
-                        cache->blocks[j].previous->next = &cache->blocks[j];
-                    if (cache->blocks[j].next != NULL)
-                        cache->blocks[j].next->previous = &cache->blocks[j];
-                    if (cache->head == &cache->blocks[j - 1])
-                        cache->head = &cache->blocks[j];
-                    if (cache->tail == &cache->blocks[j - 1])
-                        cache->tail = &cache->blocks[j];
-                    j--;
-                }
-                blk->payload.data = stale_data;
-                blk->next = cache->head;
-                cache->head->previous = blk;
-            } else {
-                cache->tail = blk;
-            }
-            cache->cur_blocks++;
-        }
-/*
-        if ((BLOCKID(*new_block) != id) || (cache->cur_blocks == 0)) {
-            block *stale_block;
-            // If the cache is not yet full, include the next free block.
-            // Otherwise, let the block in the tail position of the usage list be
-            // overwritten.
-            if (cache->cur_blocks < cache->max_blocks) {
-                stale_block = &cache->blocks[cache->cur_blocks++];
-            } else {
-                // If we are overwriting the tail position, it will eventually be moved
-                // to the head of the usage list, so terminate the forward links at its
-                // predecessor.
-                if (cache->tail->previous != NULL)
-                    cache->tail->previous->next = NULL;
-                stale_block = cache->tail;
-            }
-            // If we're lucky, the old block will be the same as the insertion
-            // point, but it's more likely that intervening blocks will need to be
-            // shifted.
-            if (stale_block != new_block) {
-                const int dir = (stale_block < new_block) ? 1 : -1;
-                ptrdiff_t j = i + stale_block - new_block;
-                // Before the old block is overwritten, save its data address (this
-                // is where the new data will go).
-                char *const data_ptr = BLOCKDATA(*stale_block);
-                // If it's the tail, move its predecessor into that position.
-                if (stale_block == cache->tail)
-                    cache->tail = cache->tail->previous;
-
-                while (i > j) {
-                    cache->blocks[j] = cache->blocks[j + dir];
-                    j += dir;
-                }
-
-                // Update the data address for the now-empty block
-                BLOCKDATA(*new_block) = data_ptr;
-            }
-        } //else {
-            // Remove the existing block from its current location in the last used
-            // list.
-            if (new_block->previous != NULL)
-                new_block->previous->next = new_block->next;
-            if (new_block->next != NULL)
-                new_block->next->previous = new_block->previous;
-        //}
-        // Move the block to the head of the list...
-        new_block->previous = NULL;
-        new_block->next = cache->head;
-        if (cache->head != NULL)
-            cache->head->previous = new_block;
-        cache->head = new_block;
-        // ...and overwrite its data
-        memcpy(BLOCKDATA(*new_block), data, length);
-        BLOCKID(*new_block) = id;
-        BLOCKSIZE(*new_block) = length;
-        return &new_block->payload;
- */
-    } else {
+    entry = lru_cache_claim(cache, id);
+    if (entry == NULL)
+        return NULL;
+    memcpy(entry->data, data, length);
+    entry->size = length;
+    return entry;
+}
+
+
+lru_cache_entry_t *lru_cache_claim(lru_cache_t *const cache, const ulong id) {
+    ulong slot = find_slot(&cache->index, id);
+    block *blk = NULL;
+    
+    if (cache->index.slots[slot] != EMPTY_SLOT) {
         // It's expected that put calls will be to insert new data into the
         // cache, but there's no reason not to allow the replacement of data in
         // existing blocks.
-        blk = &cache->blocks[i];
-        if (blk != cache->head) {
-            // Remove the block from its current location in the last used list...
-            if (blk->previous != NULL)
-                blk->previous->next = blk->next;
-            if (blk->next != NULL)
-                blk->next->previous = blk->previous;
-            // ...reassigning the list tail if necessary...
-            if (blk == cache->tail)
-                cache->tail = blk->previous;
-            // ...and move it to the head of the list.
-            blk->previous = NULL;
-            blk->next = cache->head;
-            cache->head->previous = blk;
+        blk = &cache->blocks[cache->index.slots[slot]];
+        if (blk->queue == MAIN_QUEUE) {
+            unlink_block(cache, blk);
+            push_block(cache, blk, MAIN_QUEUE);
         }
+    } else {
+        // Under 2Q, only blocks requested again since leaving the FIFO queue
+        // go straight to the main queue.
+        const int which = ((cache->policy == LRU_CACHE_2Q) && !take_ghost(cache, id))
+                ? FIFO_QUEUE : MAIN_QUEUE;
+        
+        if (cache->vacant != NULL) {
+            blk = cache->vacant;
+            cache->vacant = blk->next;
+            blk->next = NULL;
+        } else if (cache->cur_blocks < cache->max_blocks) {
+            // The first block is allocated regardless of the budget so that
+            // every cache can make progress.
+            char *const data = allocate_block(cache->block_size, cache->cur_blocks == 0);
+            if (data != NULL) {
+                blk = &cache->blocks[cache->cur_blocks++];
+                blk->payload.data = data;
+            } else if (cache->cur_blocks == 0)
+                return NULL;
+        }
+        if (blk == NULL) {
+            // Replace a block. Removing it from the index may move other
+            // slots, so the new slot is found afterwards.
+            blk = choose_victim(cache);
+            if (cache->evict != NULL)
+                cache->evict(cache->evict_context, &blk->payload);
+            unlink_block(cache, blk);
+            remove_slot(&cache->index, find_slot(&cache->index, blk->payload.id));
+            if (blk->queue == FIFO_QUEUE)
+                add_ghost(cache, blk->payload.id);
+            slot = find_slot(&cache->index, id);
+        }
+        cache->index.slots[slot] = (ulong) (blk - cache->blocks);
+        push_block(cache, blk, which);
     }
-    // Move the block to the head of the list...
-    cache->head = blk;
-    // ...and overwrite its data.
-    memcpy(blk->payload.data, data, length);
+    // Reset the block for its new data.
     blk->payload.id = id;
-    blk->payload.size = length;
+    blk->payload.size = 0;
     return &blk->payload;
 }
 
 
+void lru_cache_remove(lru_cache_t *const cache, const ulong id) {
+    const ulong slot = find_slot(&cache->index, id);
+    block *blk;
+    if (cache->index.slots[slot] == EMPTY_SLOT)
+        return;
+    
+    blk = &cache->blocks[cache->index.slots[slot]];
+    unlink_block(cache, blk);
+    remove_slot(&cache->index, slot);
+    blk->queue = VACANT;
+    blk->payload.size = 0;
+    blk->next = cache->vacant;
+    cache->vacant = blk;
+}
+
+
 const lru_cache_entry_t *lru_cache_first(const lru_cache_t *const cache) {
-    return (cache->cur_blocks > 0) ? &cache->blocks[0].payload : NULL;
+    const block *first = NULL;
+    ulong i;
+    for (i = 0; i < cache->cur_blocks; i++)
+        if ((cache->blocks[i].queue != VACANT)
+                && ((first == NULL) || (cache->blocks[i].payload.id < first->payload.id)))
+            first = &cache->blocks[i];
+    return (first != NULL) ? &first->payload : NULL;
 }
 
 
 const lru_cache_entry_t *lru_cache_last(const lru_cache_t *const cache) {
-    return (cache->cur_blocks > 0) ? &cache->blocks[cache->cur_blocks - 1].payload : NULL;
+    const block *last = NULL;
+    ulong i;
+    for (i = 0; i < cache->cur_blocks; i++)
+        if ((cache->blocks[i].queue != VACANT)
+                && ((last == NULL) || (cache->blocks[i].payload.id > last->payload.id)))
+            last = &cache->blocks[i];
+    return (last != NULL) ? &last->payload : NULL;
 }
 
 
-static long find_block(const lru_cache_t *const cache, const ulong id) {
-    long low = 0;
-    long high = cache->cur_blocks - 1;
-        
-    while (low <= high) {
-        const long mid = (low + high) / 2;
-        const ulong found_id = cache->blocks[mid].payload.id;
-
-        if (found_id < id)
-            low = mid + 1;
-        else if (found_id > id)
-            high = mid - 1;
-        else
-            return mid;
+void lru_cache_set_budget(const ulong bytes) {
+    LOCK_BUDGET();
+    budget = bytes;
+    UNLOCK_BUDGET();
+}
+
+
+ulong lru_cache_get_budget(void) {
+    ulong bytes;
+    LOCK_BUDGET();
+    bytes = budget;
+    UNLOCK_BUDGET();
+    return bytes;
+}
+
+
+ulong lru_cache_allocated(void) {
+    ulong bytes;
+    LOCK_BUDGET();
+    bytes = allocated;
+    UNLOCK_BUDGET();
+    return bytes;
+}
+
+
+int lru_cache_reserve(const ulong bytes, const int force) {
+    LOCK_BUDGET();
+    if (!force && (budget != 0) && ((allocated > budget) || (budget - allocated < bytes))) {
+        UNLOCK_BUDGET();
+        return 0;
     }
-    return -low - 1;
+    allocated += bytes;
+    UNLOCK_BUDGET();
+    return 1;
+}
+
+
+void lru_cache_unreserve(const ulong bytes) {
+    LOCK_BUDGET();
+    allocated -= bytes;
+    UNLOCK_BUDGET();
+}
+
+
+/**
+ * Allocate memory for a block, charging it to the shared budget.
+ * 
+ * @param size the size of the block.
+ * @param force if non-zero, the block is allocated even if that exceeds the
+ *              budget.
+ * @return a pointer to the memory; NULL if the budget is exhausted or there
+ *         was insufficient memory.
+ */
+static char *allocate_block(const ulong size, const int force) {
+    char *data;
+    if (!lru_cache_reserve(size, force))
+        return NULL;
+    if ((data = malloc(size)) == NULL)
+        lru_cache_unreserve(size);
+    return data;
+}
+
+
+/**
+ * Allocate an empty hash index for up to the given number of nodes.
+ * 
+ * @return non-zero on success; zero (0) if there was insufficient memory.
+ */
+static int init_index(hash_index *const index, block *const nodes, const ulong nodes_count) {
+    ulong slots = 2;
+    ulong i;
+    // Keep the index at most half full so that probe sequences stay short.
+    while (slots < nodes_count * 2)
+        slots *= 2;
+    if ((index->slots = malloc(slots * sizeof(ulong))) == NULL)
+        return 0;
+    
+    for (i = 0; i < slots; i++)
+        index->slots[i] = EMPTY_SLOT;
+    index->nodes = nodes;
+    index->mask = slots - 1;
+    return 1;
+}
+
+
+/**
+ * Return the slot at which the search for an identifier begins.
+ * 
+ * Identifiers are usually consecutive block numbers. Multiplying by an odd
+ * constant keeps consecutive values in distinct slots while spreading other
+ * patterns across the index.
+ */
+static ulong home_slot(const hash_index *const index, const ulong id) {
+    return (id * 2654435761UL) & index->mask;
+}
+
+
+/**
+ * Find the slot that holds the node with the given identifier.
+ * 
+ * @return the slot holding the node; if there is no such node, the empty
+ *         slot at which it would be inserted.
+ */
+static ulong find_slot(const hash_index *const index, const ulong id) {
+    ulong slot = home_slot(index, id);
+    while ((index->slots[slot] != EMPTY_SLOT) && (index->nodes[index->slots[slot]].payload.id != id))
+        slot = (slot + 1) & index->mask;
+    return slot;
+}
+
+
+/**
+ * Empty a slot in an index, moving later slots in the same probe sequence
+ * back to fill the gap so that no tombstones are needed.
+ */
+static void remove_slot(hash_index *const index, ulong slot) {
+    ulong next = slot;
+    for (;;) {
+        ulong home;
+        next = (next + 1) & index->mask;
+        if (index->slots[next] == EMPTY_SLOT)
+            break;
+        home = home_slot(index, index->nodes[index->slots[next]].payload.id);
+        // The entry can fill the gap only if its home slot does not lie
+        // cyclically within (slot, next].
+        if (((next - home) & index->mask) >= ((next - slot) & index->mask)) {
+            index->slots[slot] = index->slots[next];
+            slot = next;
+        }
+    }
+    index->slots[slot] = EMPTY_SLOT;
+}
+
+
+/**
+ * Choose the block to replace in a full cache: the oldest in the FIFO queue
+ * if that queue is over its share of the cache, or the least recently used in
+ * the main queue otherwise.
+ */
+static block *choose_victim(const lru_cache_t *const cache) {
+    const queue *const fifo = &cache->queues[FIFO_QUEUE];
+    if ((fifo->count > 0) && ((fifo->count > cache->max_fifo)
+            || (cache->queues[MAIN_QUEUE].count == 0)))
+        return fifo->tail;
+    return cache->queues[MAIN_QUEUE].tail;
+}
+
+
+/**
+ * Remember the identifier of a block replaced from the FIFO queue, forgetting
+ * the oldest such identifier if there are already enough.
+ */
+static void add_ghost(lru_cache_t *const cache, const ulong id) {
+    block *const ghost = &cache->ghosts[cache->next_ghost];
+    ulong slot;
+    if (ghost->queue == GHOST)
+        remove_slot(&cache->ghost_index, find_slot(&cache->ghost_index, ghost->payload.id));
+    
+    slot = find_slot(&cache->ghost_index, id);
+    if (cache->ghost_index.slots[slot] != EMPTY_SLOT) {
+        cache->ghosts[cache->ghost_index.slots[slot]].queue = VACANT;
+        remove_slot(&cache->ghost_index, slot);
+        slot = find_slot(&cache->ghost_index, id);
+    }
+    ghost->payload.id = id;
+    ghost->queue = GHOST;
+    cache->ghost_index.slots[slot] = cache->next_ghost;
+    cache->next_ghost = (cache->next_ghost + 1) % cache->max_ghosts;
+}
+
+
+/**
+ * Forget the identifier of a block replaced from the FIFO queue.
+ * 
+ * @return non-zero if the identifier was remembered; zero (0) otherwise.
+ */
+static int take_ghost(lru_cache_t *const cache, const ulong id) {
+    const ulong slot = find_slot(&cache->ghost_index, id);
+    if (cache->ghost_index.slots[slot] == EMPTY_SLOT)
+        return 0;
+    
+    cache->ghosts[cache->ghost_index.slots[slot]].queue = VACANT;
+    remove_slot(&cache->ghost_index, slot);
+    return 1;
+}
+
+
+/**
+ * Remove a block from its queue.
+ */
+static void unlink_block(lru_cache_t *const cache, block *const blk) {
+    queue *const q = &cache->queues[blk->queue];
+    if (blk->previous != NULL)
+        blk->previous->next = blk->next;
+    else
+        q->head = blk->next;
+    if (blk->next != NULL)
+        blk->next->previous = blk->previous;
+    else
+        q->tail = blk->previous;
+    blk->next = NULL;
+    blk->previous = NULL;
+    q->count--;
+}
+
+
+/**
+ * Insert a block at the head of a queue.
+ */
+static void push_block(lru_cache_t *const cache, block *const blk, const int which) {
+    queue *const q = &cache->queues[which];
+    blk->queue = which;
+    blk->previous = NULL;
+    blk->next = q->head;
+    if (q->head != NULL)
+        q->head->previous = blk;
+    else
+        q->tail = blk;
+    q->head = blk;
+    q->count++;
 }
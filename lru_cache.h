@@ -8,6 +8,8 @@
 #ifndef LRU_CACHE_H
 #define	LRU_CACHE_H
 
+#include "config.h"
+
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,10 +32,38 @@ extern "C" {
      * 
      * When an entry is added or retrieved from the cache, it is moved to the
      * head of an internal usage list. Once the cache is full, the entry in the
-     * tail position is replaced.
+     * tail position is replaced. Alternatively, the cache can follow the
+     * scan-resistant 2Q policy; see lru_cache_policy.
+     * 
+     * Entries are located through an open-addressed hash index, so lookups
+     * and replacements take constant time regardless of the number of
+     * entries.
+     * 
+     * Memory for entries is allocated as they are first claimed, and is
+     * drawn from a budget shared by every cache in the process. Once the
+     * budget is exhausted, a cache replaces its own least recently used entry
+     * rather than growing, though every cache may hold at least one entry.
      */
     typedef struct lru_cache lru_cache_t;
     
+    /**
+     * The retention policies a cache can follow.
+     */
+    typedef enum {
+        /**
+         * Replace the least recently used entry.
+         */
+        LRU_CACHE_LRU,
+        /**
+         * The 2Q policy, which resists being flushed by a single pass over
+         * many entries. Entries first enter a small FIFO queue, which holds a
+         * quarter of the cache, and are replaced from there unless they are
+         * requested again soon after leaving it. Those are moved to the main
+         * queue, which is managed as a least recently used list.
+         */
+        LRU_CACHE_2Q
+    } lru_cache_policy;
+    
     /**
      * Entries retrieved from the cache are presented in an instance of this
      * structure.
@@ -59,15 +89,34 @@ extern "C" {
     } lru_cache_entry_t;
     
     /**
-     * Allocate and initialise the least recently used cache.
+     * A function to be called with an entry that is about to be replaced,
+     * while its data is still intact.
+     */
+    typedef void (*lru_cache_evict_func)(void *const context, const lru_cache_entry_t *const entry);
+    
+    /**
+     * Allocate and initialise the least recently used cache. No memory is
+     * allocated for entries until they are used.
      * 
      * @param blocks the maximum number of entries that can comprise this
      *               cache. Cannot be zero (0).
      * @param block_size the maximum size of each entry in the cache. Cannot be
      *                   zero (0).
+     * @param policy the retention policy of the cache.
      * @return the cache on success; NULL if insufficient memory.
      */
-    lru_cache_t *lru_cache_init(const ulong blocks, const ulong block_size);
+    lru_cache_t *lru_cache_init(const ulong blocks, const ulong block_size,
+                                const lru_cache_policy policy);
+    /**
+     * Register a function to be called whenever an entry is replaced to make
+     * room for another, replacing any function registered before.
+     * 
+     * @param cache a pointer to the cache to observe.
+     * @param func the function to call, or NULL for none.
+     * @param context a pointer passed to the function.
+     */
+    void lru_cache_on_evict(lru_cache_t *const cache, lru_cache_evict_func func,
+                            void *const context);
     /**
      * Deallocate the cache and the data stored therein.
      * 
@@ -78,9 +127,10 @@ extern "C" {
     /**
      * Get an entry from the cache with the corresponding identifier.
      * 
-     * Successful retrieval promotes the entry to the head of the usage list.
+     * Successful retrieval promotes the entry to the head of the usage list,
+     * unless it is in the FIFO queue of the 2Q policy.
      * 
-     * This function runs in O(log n) time, where n is the number of entries.
+     * This function runs in O(1) expected time.
      * 
      * @param cache a pointer to the cache to search for an entry.
      * @param id the identifier of the entry to retrieve.
@@ -94,8 +144,8 @@ extern "C" {
      * 
      * The new entry is promoted to the head of the usage list.
      * 
-     * This function runs in O(log n + n + m) time in the worst case, where n
-     * is the number of entries and m is size of added entry.
+     * This function runs in O(m) expected time, where m is size of added
+     * entry.
      * 
      * @param cache a pointer to the cache to populate.
      * @param id the identifier of the entry.
@@ -103,10 +153,39 @@ extern "C" {
      *             unless length is zero (0).
      * @param length the number of bytes to copy into the cache. May not exceed
      *               the block size used when instantiating the cache.
-     * @return a pointer to the new entry.
+     * @return a pointer to the new entry; NULL if the cache is empty and
+     *         memory for its first entry could not be allocated.
      */
     const lru_cache_entry_t *lru_cache_put(lru_cache_t *const cache, const ulong id,
                                            const char *data, const ulong length);
+    /**
+     * Claim an entry in the cache for the given identifier without copying
+     * any data into it, so that the caller can fill it in place. The entry is
+     * selected and promoted exactly as it would be by lru_cache_put.
+     * 
+     * Unlike other entries, the caller may write up to the block size used
+     * when instantiating the cache to the data field of the returned entry,
+     * and must then set its size field to the number of bytes written. The
+     * size is zero (0) until then.
+     * 
+     * This function runs in O(1) expected time.
+     * 
+     * @param cache a pointer to the cache to populate.
+     * @param id the identifier of the entry.
+     * @return a pointer to the claimed entry; NULL if the cache is empty and
+     *         memory for its first entry could not be allocated.
+     */
+    lru_cache_entry_t *lru_cache_claim(lru_cache_t *const cache, const ulong id);
+    /**
+     * Remove the entry with the given identifier, if any, such as one claimed
+     * but never filled. Its memory is kept for the next entry claimed.
+     * 
+     * This function runs in O(1) expected time.
+     * 
+     * @param cache a pointer to the cache from which the entry is removed.
+     * @param id the identifier of the entry.
+     */
+    void lru_cache_remove(lru_cache_t *const cache, const ulong id);
     
     /**
      * Return the entry with the lowest identifier.
@@ -114,7 +193,7 @@ extern "C" {
      * The position of the entry in the usage list is not modified by this
      * function.
      * 
-     * This function runs in O(1) time.
+     * This function runs in O(n) time, where n is the number of entries.
      * 
      * @param cache a pointer to the cache from which the entry is obtained.
      * @return a pointer to the first entry, or NULL if the cache is empty.
@@ -126,12 +205,45 @@ extern "C" {
      * The position of the entry in the usage list is not modified by this
      * function.
      * 
-     * This function runs in O(1) time.
+     * This function runs in O(n) time, where n is the number of entries.
      * 
      * @param cache a pointer to the cache from which the entry is obtained.
      * @return a pointer to the last entry, or NULL if the cache is empty.
      */
     const lru_cache_entry_t *lru_cache_last(const lru_cache_t *const cache);
+    
+    /**
+     * Set the number of bytes that all caches in the process may allocate for
+     * their entries. Entries already allocated are kept even if they exceed
+     * the new budget.
+     * 
+     * @param bytes the budget, or zero (0) for no limit, which is the default.
+     */
+    void lru_cache_set_budget(const ulong bytes);
+    /**
+     * Return the budget set by lru_cache_set_budget.
+     */
+    ulong lru_cache_get_budget(void);
+    /**
+     * Return the number of bytes currently allocated for entries by all caches
+     * in the process, including those charged by lru_cache_reserve.
+     */
+    ulong lru_cache_allocated(void);
+    /**
+     * Charge memory allocated outside any cache, such as for blocks shared
+     * between streams, to the budget.
+     * 
+     * @param bytes the number of bytes.
+     * @param force if non-zero, the bytes are charged even if that exceeds
+     *              the budget.
+     * @return non-zero if the bytes were charged; zero (0) if the budget is
+     *         exhausted.
+     */
+    int lru_cache_reserve(const ulong bytes, const int force);
+    /**
+     * Return memory charged by lru_cache_reserve to the budget.
+     */
+    void lru_cache_unreserve(const ulong bytes);
 
 #ifdef	__cplusplus
 }
@@ -0,0 +1,190 @@
+#include "match_kernel.h"
+#include <string.h>
+
+#if SIMD_MATCH
+#include <immintrin.h>
+#endif
+
+typedef size_t (*match_func)(const uint8_t *const, const uint8_t *const, const size_t);
+
+/**
+ * The forward and backward kernels for one instruction set.
+ */
+typedef struct {
+    match_func forward;
+    match_func backward;
+} match_kernels;
+
+static size_t match_forward_scalar(const uint8_t *const, const uint8_t *const, const size_t);
+static size_t match_backward_scalar(const uint8_t *const, const uint8_t *const, const size_t);
+#if SIMD_MATCH
+static size_t match_forward_sse2(const uint8_t *const, const uint8_t *const, const size_t);
+static size_t match_backward_sse2(const uint8_t *const, const uint8_t *const, const size_t);
+static size_t match_forward_avx2(const uint8_t *const, const uint8_t *const, const size_t);
+static size_t match_backward_avx2(const uint8_t *const, const uint8_t *const, const size_t);
+#endif
+static const match_kernels *choose_kernels(void);
+
+static const match_kernels scalar_kernels = {match_forward_scalar, match_backward_scalar};
+#if SIMD_MATCH
+static const match_kernels sse2_kernels = {match_forward_sse2, match_backward_sse2};
+static const match_kernels avx2_kernels = {match_forward_avx2, match_backward_avx2};
+#endif
+
+/* The kernels in use. They are chosen by match_kernel_init before any engine
+ * runs, and only read afterwards. */
+static const match_kernels *kernels = &scalar_kernels;
+
+
+void match_kernel_init(void) {
+    kernels = choose_kernels();
+}
+
+
+size_t match_forward(const uint8_t *const s1, const uint8_t *const s2, const size_t length) {
+    return kernels->forward(s1, s2, length);
+}
+
+
+size_t match_backward(const uint8_t *const s1, const uint8_t *const s2, const size_t length) {
+    return kernels->backward(s1, s2, length);
+}
+
+
+/**
+ * Choose the fastest kernels that the processor supports.
+ */
+static const match_kernels *choose_kernels(void) {
+#if SIMD_MATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return &avx2_kernels;
+    if (__builtin_cpu_supports("sse2"))
+        return &sse2_kernels;
+#endif
+    return &scalar_kernels;
+}
+
+
+/**
+ * Compare a word at a time, then finish byte by byte. Words are copied out
+ * so that neither string need be aligned.
+ */
+static size_t match_forward_scalar(const uint8_t *const s1, const uint8_t *const s2,
+        const size_t length) {
+    size_t i = 0;
+    size_t w1, w2;
+    
+    for (; i + sizeof(size_t) <= length; i += sizeof(size_t)) {
+        memcpy(&w1, s1 + i, sizeof(size_t));
+        memcpy(&w2, s2 + i, sizeof(size_t));
+        if (w1 != w2)
+            break;
+    }
+    while ((i < length) && (s1[i] == s2[i]))
+        i++;
+    return i;
+}
+
+
+/**
+ * As match_forward_scalar, working back from the ends of the strings.
+ */
+static size_t match_backward_scalar(const uint8_t *const s1, const uint8_t *const s2,
+        const size_t length) {
+    size_t i = 0;
+    size_t w1, w2;
+    
+    for (; i + sizeof(size_t) <= length; i += sizeof(size_t)) {
+        memcpy(&w1, s1 - i - sizeof(size_t), sizeof(size_t));
+        memcpy(&w2, s2 - i - sizeof(size_t), sizeof(size_t));
+        if (w1 != w2)
+            break;
+    }
+    while ((i < length) && (s1[-(ptrdiff_t) i - 1] == s2[-(ptrdiff_t) i - 1]))
+        i++;
+    return i;
+}
+
+
+#if SIMD_MATCH
+/**
+ * Compare sixteen bytes at a time. The first mismatch within a vector is
+ * the lowest clear bit of the byte equality mask.
+ */
+__attribute__((target("sse2")))
+static size_t match_forward_sse2(const uint8_t *const s1, const uint8_t *const s2,
+        const size_t length) {
+    size_t i = 0;
+    
+    for (; i + 16 <= length; i += 16) {
+        const __m128i a = _mm_loadu_si128((const __m128i *) (s1 + i));
+        const __m128i b = _mm_loadu_si128((const __m128i *) (s2 + i));
+        const unsigned mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xffffu;
+        if (mask != 0)
+            return i + (size_t) __builtin_ctz(mask);
+    }
+    return i + match_forward_scalar(s1 + i, s2 + i, length - i);
+}
+
+
+/**
+ * Compare the sixteen bytes before each position. The mismatch nearest the
+ * end of a vector is its highest clear bit, which lies in the low half of
+ * the 32-bit mask.
+ */
+__attribute__((target("sse2")))
+static size_t match_backward_sse2(const uint8_t *const s1, const uint8_t *const s2,
+        const size_t length) {
+    size_t i = 0;
+    
+    for (; i + 16 <= length; i += 16) {
+        const __m128i a = _mm_loadu_si128((const __m128i *) (s1 - i - 16));
+        const __m128i b = _mm_loadu_si128((const __m128i *) (s2 - i - 16));
+        const unsigned mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xffffu;
+        if (mask != 0)
+            return i + (size_t) (__builtin_clz(mask) - 16);
+    }
+    return i + match_backward_scalar(s1 - i, s2 - i, length - i);
+}
+
+
+/**
+ * Compare thirty-two bytes at a time, leaving any shorter tail to the SSE2
+ * kernel.
+ */
+__attribute__((target("avx2")))
+static size_t match_forward_avx2(const uint8_t *const s1, const uint8_t *const s2,
+        const size_t length) {
+    size_t i = 0;
+    
+    for (; i + 32 <= length; i += 32) {
+        const __m256i a = _mm256_loadu_si256((const __m256i *) (s1 + i));
+        const __m256i b = _mm256_loadu_si256((const __m256i *) (s2 + i));
+        const unsigned mask = ~(unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+        if (mask != 0)
+            return i + (size_t) __builtin_ctz(mask);
+    }
+    return i + match_forward_sse2(s1 + i, s2 + i, length - i);
+}
+
+
+/**
+ * Compare the thirty-two bytes before each position, leaving any shorter
+ * tail to the SSE2 kernel.
+ */
+__attribute__((target("avx2")))
+static size_t match_backward_avx2(const uint8_t *const s1, const uint8_t *const s2,
+        const size_t length) {
+    size_t i = 0;
+    
+    for (; i + 32 <= length; i += 32) {
+        const __m256i a = _mm256_loadu_si256((const __m256i *) (s1 - i - 32));
+        const __m256i b = _mm256_loadu_si256((const __m256i *) (s2 - i - 32));
+        const unsigned mask = ~(unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+        if (mask != 0)
+            return i + (size_t) __builtin_clz(mask);
+    }
+    return i + match_backward_sse2(s1 - i, s2 - i, length - i);
+}
+#endif
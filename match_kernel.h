@@ -0,0 +1,53 @@
+/* 
+ * File:   match_kernel.h
+ * Author: Michael Winter <mail@michael-winter.me.uk>
+ *
+ * Created on 16 October 2026, 21:10
+ */
+
+#ifndef MATCH_KERNEL_H
+#define	MATCH_KERNEL_H
+
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+    /**
+     * Choose the fastest kernels that the processor supports. This must be
+     * called once, before any thread uses match_forward or match_backward;
+     * until then, the scalar kernels are used.
+     */
+    void match_kernel_init(void);
+    /**
+     * Count the bytes that two strings have in common from their start,
+     * comparing 32 or 16 bytes at a time where the processor supports AVX2
+     * or SSE2, once chosen by match_kernel_init.
+     * 
+     * @param s1 a pointer to the first string.
+     * @param s2 a pointer to the second string, which may overlap the first.
+     * @param length the number of bytes that may be compared.
+     * @return the length of the common prefix, at most length.
+     */
+    size_t match_forward(const uint8_t *const s1, const uint8_t *const s2, const size_t length);
+    /**
+     * Count the bytes that two strings have in common before the given
+     * positions, working backwards in the same way as match_forward.
+     * 
+     * @param s1 a pointer just past the end of the first string.
+     * @param s2 a pointer just past the end of the second string.
+     * @param length the number of bytes before each pointer that may be
+     *               compared.
+     * @return the length of the common suffix, at most length.
+     */
+    size_t match_backward(const uint8_t *const s1, const uint8_t *const s2, const size_t length);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* MATCH_KERNEL_H */
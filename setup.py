@@ -7,6 +7,9 @@ setup(name='DjangoDelta',
       author_email='mail@michael-winter.me.uk',
       license='GPLv2+',
       py_modules=['xdelta'],
-      ext_modules=[Extension('_xdelta', ['deltamodule.c', 'xdelta3.c', 'buffer.c', 'lru_cache.c'],
+      ext_modules=[Extension('_xdelta', ['deltamodule.c', 'xdelta3.c', 'lru_cache.c', 'source_reader.c',
+                                         'thread_pool.c', 'window_index.c',
+                                         'delta_merge.c', 'shared_cache.c',
+                                         'compressed_cache.c', 'match_kernel.c'],
                              define_macros=[('HAVE_CONFIG_H', '1')])],
       test_suite='tests')
@@ -0,0 +1,476 @@
+#include "shared_cache.h"
+#include <assert.h>
+
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/* The number of independently locked stripes. Must be a power of two. */
+#define STRIPES 16
+/* The initial number of hash buckets in each stripe. Must be a power of
+ * two. */
+#define INITIAL_BUCKETS 16
+/* The default capacity of the cache. */
+#define DEFAULT_CAPACITY (64UL * 1024 * 1024)
+
+#if HAVE_PTHREAD
+#define LOCK(MUTEX) pthread_mutex_lock(&(MUTEX))
+#define UNLOCK(MUTEX) pthread_mutex_unlock(&(MUTEX))
+#else
+#define LOCK(MUTEX)
+#define UNLOCK(MUTEX)
+#endif
+
+struct shared_cache_source {
+    char *key;
+    ulong block_size;
+    /* The number of times the source is open plus the number of its blocks
+     * allocated, so that the source outlives the streams that read it for
+     * as long as any of its blocks are cached. */
+    ulong refs;
+    struct shared_cache_source *next;
+};
+
+typedef struct blk {
+    lru_cache_entry_t payload;
+    shared_cache_source_t *source;
+    ulong hash;
+    ulong refs;
+    /* The next block in the same hash bucket. */
+    struct blk *chain;
+    /* The neighbours of an unreferenced block in the idle list of its stripe,
+     * which is ordered from most to least recently used. */
+    struct blk *next;
+    struct blk *previous;
+} block;
+
+typedef struct {
+#if HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+    block **buckets;
+    ulong bucket_mask;
+    ulong count;
+    block *idle_head;
+    block *idle_tail;
+} stripe;
+
+static stripe stripes[STRIPES];
+static shared_cache_source_t *sources = NULL;
+static ulong capacity = DEFAULT_CAPACITY;
+static ulong allocated = 0;
+/* The stripe from which trimming next starts, so that eviction is spread
+ * across stripes. */
+static ulong next_trim = 0;
+#if HAVE_PTHREAD
+static pthread_mutex_t sources_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t usage_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t initialised = PTHREAD_ONCE_INIT;
+#endif
+
+static void initialise(void);
+static void initialise_once(void);
+static ulong hash_block(const shared_cache_source_t *const source, const ulong id);
+static block *find_block(const stripe *const s, const shared_cache_source_t *const source,
+                         const ulong id, const ulong hash);
+static int insert_block(stripe *const s, block *const blk);
+static void remove_block(stripe *const s, block *const blk);
+static void unlink_idle(stripe *const s, block *const blk);
+static void free_block(block *const blk);
+static void release_source(shared_cache_source_t *const source);
+static int over_capacity(void);
+static int trim(const ulong reserve);
+
+
+shared_cache_source_t *shared_cache_open(const char *const key, const ulong block_size) {
+    shared_cache_source_t *source;
+    assert(block_size != 0);
+    
+    LOCK(sources_lock);
+    for (source = sources; source != NULL; source = source->next)
+        if ((source->block_size == block_size) && (strcmp(source->key, key) == 0))
+            break;
+    if (source == NULL) {
+        if ((source = malloc(sizeof *source)) != NULL) {
+            if ((source->key = malloc(strlen(key) + 1)) != NULL) {
+                strcpy(source->key, key);
+                source->block_size = block_size;
+                source->refs = 0;
+                source->next = sources;
+                sources = source;
+            } else {
+                free(source);
+                source = NULL;
+            }
+        }
+    }
+    if (source != NULL)
+        source->refs++;
+    UNLOCK(sources_lock);
+    return source;
+}
+
+
+void shared_cache_close(shared_cache_source_t *const source) {
+    if (source != NULL)
+        release_source(source);
+}
+
+
+const lru_cache_entry_t *shared_cache_get(shared_cache_source_t *const source, const ulong id) {
+    const ulong hash = hash_block(source, id);
+    stripe *const s = &stripes[hash & (STRIPES - 1)];
+    block *blk;
+    
+    initialise();
+    LOCK(s->lock);
+    if ((blk = find_block(s, source, id, hash)) != NULL) {
+        if (blk->refs++ == 0)
+            unlink_idle(s, blk);
+    }
+    UNLOCK(s->lock);
+    return (blk != NULL) ? &blk->payload : NULL;
+}
+
+
+lru_cache_entry_t *shared_cache_claim(shared_cache_source_t *const source, const ulong id) {
+    block *blk;
+    // Idle blocks are given up to stay within the budget shared with other
+    // caches. A block about to be used is allocated regardless, as each
+    // stream holds few at a time.
+    if (!lru_cache_reserve(source->block_size, 0) && !trim(source->block_size))
+        lru_cache_reserve(source->block_size, 1);
+    // The block and its data are allocated together.
+    if ((blk = malloc(sizeof(block) + source->block_size)) == NULL) {
+        lru_cache_unreserve(source->block_size);
+        return NULL;
+    }
+    
+    blk->payload.id = id;
+    blk->payload.data = (char *) (blk + 1);
+    blk->payload.size = 0;
+    blk->source = source;
+    blk->hash = hash_block(source, id);
+    blk->refs = 1;
+    blk->chain = NULL;
+    blk->next = NULL;
+    blk->previous = NULL;
+    
+    LOCK(sources_lock);
+    source->refs++;
+    UNLOCK(sources_lock);
+    LOCK(usage_lock);
+    allocated += source->block_size;
+    UNLOCK(usage_lock);
+    return &blk->payload;
+}
+
+
+const lru_cache_entry_t *shared_cache_publish(lru_cache_entry_t *const entry) {
+    block *const blk = (block *) entry;
+    stripe *const s = &stripes[blk->hash & (STRIPES - 1)];
+    block *existing;
+    
+    initialise();
+    LOCK(s->lock);
+    if ((existing = find_block(s, blk->source, entry->id, blk->hash)) != NULL) {
+        if (existing->refs++ == 0)
+            unlink_idle(s, existing);
+    } else if (!insert_block(s, blk)) {
+        // Without room in the index, the block is simply not shared.
+        UNLOCK(s->lock);
+        return entry;
+    }
+    UNLOCK(s->lock);
+    
+    if (existing != NULL) {
+        free_block(blk);
+        return &existing->payload;
+    }
+    if (over_capacity())
+        trim(0);
+    return entry;
+}
+
+
+void shared_cache_abandon(lru_cache_entry_t *const entry) {
+    free_block((block *) entry);
+}
+
+
+const lru_cache_entry_t *shared_cache_put(shared_cache_source_t *const source, const ulong id,
+                                          const char *const data, const ulong length) {
+    lru_cache_entry_t *const entry = shared_cache_claim(source, id);
+    assert(length <= source->block_size);
+    if (entry == NULL)
+        return NULL;
+    
+    memcpy(entry->data, data, length);
+    entry->size = length;
+    return shared_cache_publish(entry);
+}
+
+
+void shared_cache_release(const lru_cache_entry_t *const entry) {
+    block *const blk = (block *) entry;
+    stripe *const s = &stripes[blk->hash & (STRIPES - 1)];
+    int idle = 0;
+    int unshared = 0;
+    
+    LOCK(s->lock);
+    if (--blk->refs == 0) {
+        if (find_block(s, blk->source, entry->id, blk->hash) == blk) {
+            idle = 1;
+            blk->previous = NULL;
+            blk->next = s->idle_head;
+            if (s->idle_head != NULL)
+                s->idle_head->previous = blk;
+            else
+                s->idle_tail = blk;
+            s->idle_head = blk;
+        } else
+            unshared = 1;
+    }
+    UNLOCK(s->lock);
+    
+    if (unshared)
+        free_block(blk);
+    else if (idle && over_capacity())
+        trim(0);
+}
+
+
+void shared_cache_set_capacity(const ulong bytes) {
+    LOCK(usage_lock);
+    capacity = bytes;
+    UNLOCK(usage_lock);
+    trim(0);
+}
+
+
+ulong shared_cache_get_capacity(void) {
+    ulong bytes;
+    LOCK(usage_lock);
+    bytes = capacity;
+    UNLOCK(usage_lock);
+    return bytes;
+}
+
+
+ulong shared_cache_allocated(void) {
+    ulong bytes;
+    LOCK(usage_lock);
+    bytes = allocated;
+    UNLOCK(usage_lock);
+    return bytes;
+}
+
+
+/**
+ * Prepare the stripes for use, once.
+ */
+static void initialise(void) {
+#if HAVE_PTHREAD
+    pthread_once(&initialised, initialise_once);
+#else
+    static int done = 0;
+    if (!done) {
+        initialise_once();
+        done = 1;
+    }
+#endif
+}
+
+
+static void initialise_once(void) {
+    ulong i;
+    for (i = 0; i < STRIPES; i++) {
+#if HAVE_PTHREAD
+        pthread_mutex_init(&stripes[i].lock, NULL);
+#endif
+        stripes[i].buckets = NULL;
+        stripes[i].bucket_mask = 0;
+        stripes[i].count = 0;
+        stripes[i].idle_head = NULL;
+        stripes[i].idle_tail = NULL;
+    }
+}
+
+
+/**
+ * Return the hash of a block, of which the low bits select its stripe and
+ * the remainder its bucket within the stripe.
+ */
+static ulong hash_block(const shared_cache_source_t *const source, const ulong id) {
+    ulong hash = ((ulong) (size_t) source >> 4) * 31 + id;
+    hash *= 2654435761UL;
+    return hash ^ (hash >> 15);
+}
+
+
+/**
+ * Find a published block in a stripe. The stripe must be locked.
+ */
+static block *find_block(const stripe *const s, const shared_cache_source_t *const source,
+                         const ulong id, const ulong hash) {
+    block *blk;
+    if (s->buckets == NULL)
+        return NULL;
+    
+    for (blk = s->buckets[(hash / STRIPES) & s->bucket_mask]; blk != NULL; blk = blk->chain)
+        if ((blk->source == source) && (blk->payload.id == id))
+            return blk;
+    return NULL;
+}
+
+
+/**
+ * Add a block to the index of a stripe, growing the index if it is full. The
+ * stripe must be locked.
+ * 
+ * @return non-zero on success; zero (0) if there was insufficient memory.
+ */
+static int insert_block(stripe *const s, block *const blk) {
+    ulong bucket;
+    if ((s->buckets == NULL) || (s->count > s->bucket_mask)) {
+        const ulong count = (s->buckets == NULL) ? INITIAL_BUCKETS : (s->bucket_mask + 1) * 2;
+        block **const buckets = calloc(count, sizeof(block *));
+        if (buckets != NULL) {
+            ulong i;
+            for (i = 0; (s->buckets != NULL) && (i <= s->bucket_mask); i++) {
+                while (s->buckets[i] != NULL) {
+                    block *const moved = s->buckets[i];
+                    s->buckets[i] = moved->chain;
+                    moved->chain = buckets[(moved->hash / STRIPES) & (count - 1)];
+                    buckets[(moved->hash / STRIPES) & (count - 1)] = moved;
+                }
+            }
+            free(s->buckets);
+            s->buckets = buckets;
+            s->bucket_mask = count - 1;
+        } else if (s->buckets == NULL)
+            return 0;
+    }
+    bucket = (blk->hash / STRIPES) & s->bucket_mask;
+    blk->chain = s->buckets[bucket];
+    s->buckets[bucket] = blk;
+    s->count++;
+    return 1;
+}
+
+
+/**
+ * Remove a block from the index of a stripe. The stripe must be locked.
+ */
+static void remove_block(stripe *const s, block *const blk) {
+    block **link = &s->buckets[(blk->hash / STRIPES) & s->bucket_mask];
+    while (*link != blk)
+        link = &(*link)->chain;
+    *link = blk->chain;
+    s->count--;
+}
+
+
+/**
+ * Remove a block from the idle list of a stripe. The stripe must be locked.
+ */
+static void unlink_idle(stripe *const s, block *const blk) {
+    if (blk->previous != NULL)
+        blk->previous->next = blk->next;
+    else
+        s->idle_head = blk->next;
+    if (blk->next != NULL)
+        blk->next->previous = blk->previous;
+    else
+        s->idle_tail = blk->previous;
+    blk->next = NULL;
+    blk->previous = NULL;
+}
+
+
+/**
+ * Deallocate a block that is no longer indexed.
+ */
+static void free_block(block *const blk) {
+    shared_cache_source_t *const source = blk->source;
+    LOCK(usage_lock);
+    allocated -= source->block_size;
+    UNLOCK(usage_lock);
+    lru_cache_unreserve(source->block_size);
+    free(blk);
+    release_source(source);
+}
+
+
+/**
+ * Drop a reference to a source, deallocating it once nothing refers to it.
+ */
+static void release_source(shared_cache_source_t *const source) {
+    int unused;
+    LOCK(sources_lock);
+    if ((unused = (--source->refs == 0))) {
+        shared_cache_source_t **link = &sources;
+        while (*link != source)
+            link = &(*link)->next;
+        *link = source->next;
+    }
+    UNLOCK(sources_lock);
+    
+    if (unused) {
+        free(source->key);
+        free(source);
+    }
+}
+
+
+static int over_capacity(void) {
+    int over;
+    LOCK(usage_lock);
+    over = allocated > capacity;
+    UNLOCK(usage_lock);
+    return over;
+}
+
+
+/**
+ * Evict unreferenced blocks, least recently used first within each stripe,
+ * until the cache is within its capacity or no more can be evicted.
+ * 
+ * Only one stripe is locked at a time, so this never waits on a thread that
+ * holds another.
+ * 
+ * @param reserve if non-zero, evict instead until this many bytes can be
+ *                charged to the budget of lru_cache_reserve, and charge them.
+ * @return non-zero if the bytes were charged, or the cache is within its
+ *         capacity; zero (0) otherwise.
+ */
+static int trim(const ulong reserve) {
+    ulong i;
+    ulong start;
+    
+    initialise();
+    LOCK(usage_lock);
+    start = next_trim++;
+    UNLOCK(usage_lock);
+    for (i = 0; i < STRIPES;) {
+        stripe *const s = &stripes[(start + i) & (STRIPES - 1)];
+        block *evicted = NULL;
+        
+        if ((reserve != 0) ? lru_cache_reserve(reserve, 0) : !over_capacity())
+            return 1;
+        LOCK(s->lock);
+        if (s->idle_tail != NULL) {
+            evicted = s->idle_tail;
+            unlink_idle(s, evicted);
+            remove_block(s, evicted);
+        }
+        UNLOCK(s->lock);
+        
+        // Stay on this stripe while it has idle blocks to give up.
+        if (evicted != NULL)
+            free_block(evicted);
+        else
+            i++;
+    }
+    return 0;
+}
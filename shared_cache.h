@@ -0,0 +1,149 @@
+/* 
+ * File:   shared_cache.h
+ * Author: Michael Winter <mail@michael-winter.me.uk>
+ *
+ * Created on 16 October 2026, 16:05
+ */
+
+#ifndef SHARED_CACHE_H
+#define	SHARED_CACHE_H
+
+#include "config.h"
+#include "lru_cache.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+    typedef unsigned long ulong;
+
+    /**
+     * A source whose blocks are held in the process-wide shared cache.
+     * 
+     * Sources are identified by a key and a block size: every stream that
+     * opens a source with the same key and block size shares its blocks.
+     * Keys must therefore identify the content of a source, and change
+     * whenever it does, as blocks outlive the streams that read them.
+     * 
+     * Entries are presented as lru_cache_entry_t structures, in which id is
+     * the block number, and are reference counted: an entry obtained from
+     * shared_cache_get, shared_cache_publish or shared_cache_put remains valid
+     * until it is passed to shared_cache_release. Unreferenced entries are
+     * evicted, least recently used first, once the cache exceeds its
+     * capacity.
+     * 
+     * The cache is divided into stripes, each with its own lock, so that
+     * threads seldom wait for each other. All functions are thread-safe where
+     * threads are available.
+     */
+    typedef struct shared_cache_source shared_cache_source_t;
+
+    /**
+     * Open a source in the shared cache, creating it if necessary.
+     * 
+     * @param key a null-terminated string identifying the content of the
+     *            source. It is copied.
+     * @param block_size the size of each block of the source. Cannot be zero
+     *                   (0).
+     * @return the source on success; NULL if there was insufficient memory.
+     */
+    shared_cache_source_t *shared_cache_open(const char *const key, const ulong block_size);
+    /**
+     * Close a source opened by shared_cache_open. Its blocks remain cached
+     * for others that open the same source until they are evicted.
+     * 
+     * @param source a pointer to the source to close.
+     */
+    void shared_cache_close(shared_cache_source_t *const source);
+
+    /**
+     * Get a block of a source from the cache and hold a reference to it.
+     * 
+     * @param source a pointer to the source of the block.
+     * @param id the number of the block.
+     * @return a pointer to the entry on success; NULL if it is not cached.
+     */
+    const lru_cache_entry_t *shared_cache_get(shared_cache_source_t *const source, const ulong id);
+    /**
+     * Allocate an entry for a block of a source so that the caller can fill
+     * it in place before it is published. The caller may write up to the
+     * block size of the source to its data field, and must set its size
+     * field to the number of bytes written.
+     * 
+     * The entry is not visible to others until it is passed to
+     * shared_cache_publish, and must be passed to that function or to
+     * shared_cache_abandon.
+     * 
+     * @param source a pointer to the source of the block.
+     * @param id the number of the block.
+     * @return a pointer to the entry on success; NULL if there was
+     *         insufficient memory.
+     */
+    lru_cache_entry_t *shared_cache_claim(shared_cache_source_t *const source, const ulong id);
+    /**
+     * Add an entry obtained from shared_cache_claim to the cache.
+     * 
+     * If another thread published the same block in the meantime, the given
+     * entry is discarded in favour of that one.
+     * 
+     * @param entry a pointer to the entry to publish.
+     * @return a pointer to the cached entry, to which the caller holds a
+     *         reference.
+     */
+    const lru_cache_entry_t *shared_cache_publish(lru_cache_entry_t *const entry);
+    /**
+     * Discard an entry obtained from shared_cache_claim without publishing
+     * it.
+     * 
+     * @param entry a pointer to the entry to discard.
+     */
+    void shared_cache_abandon(lru_cache_entry_t *const entry);
+    /**
+     * Copy a block of a source into the cache and hold a reference to it.
+     * 
+     * @param source a pointer to the source of the block.
+     * @param id the number of the block.
+     * @param data a pointer to the content of the block.
+     * @param length the length of the block. May not exceed the block size of
+     *               the source.
+     * @return a pointer to the cached entry on success; NULL if there was
+     *         insufficient memory.
+     */
+    const lru_cache_entry_t *shared_cache_put(shared_cache_source_t *const source, const ulong id,
+                                              const char *const data, const ulong length);
+    /**
+     * Release a reference to an entry.
+     * 
+     * @param entry a pointer to the entry to release.
+     */
+    void shared_cache_release(const lru_cache_entry_t *const entry);
+
+    /**
+     * Set the number of bytes of block data the shared cache may retain.
+     * Blocks that are referenced are never evicted, so the cache may exceed
+     * its capacity while they are in use. Block data is also charged to the
+     * budget set by lru_cache_set_budget, and idle blocks are evicted to
+     * stay within it.
+     * 
+     * @param bytes the capacity.
+     */
+    void shared_cache_set_capacity(const ulong bytes);
+    /**
+     * Return the capacity set by shared_cache_set_capacity.
+     */
+    ulong shared_cache_get_capacity(void);
+    /**
+     * Return the number of bytes currently allocated for block data by the
+     * shared cache.
+     */
+    ulong shared_cache_allocated(void);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* SHARED_CACHE_H */
@@ -0,0 +1,217 @@
+
+#include "source_reader.h"
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#if NATIVE_SOURCE_READER
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* The state of the readahead buffer. */
+typedef enum {
+    /* The buffer holds nothing of use. */
+    AHEAD_IDLE,
+    /* The thread has been asked to read ahead_block. */
+    AHEAD_WANTED,
+    /* The thread is reading ahead_block into the buffer. */
+    AHEAD_READING,
+    /* The buffer holds ahead_block. */
+    AHEAD_READY
+} ahead_state;
+
+struct source_reader {
+    int fd;
+    off_t offset;
+    ulong block_size;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int stopping;
+
+    char *ahead;
+    ulong ahead_block;
+    long ahead_size;
+    ahead_state state;
+};
+
+static void *readahead_main(void *);
+static long read_block(const source_reader_t *const, const ulong, char *const);
+
+
+source_reader_t *source_reader_init(const int fd, const off_t offset, const ulong block_size) {
+    source_reader_t *reader;
+    struct stat info;
+    assert(block_size != 0);
+
+    // Only regular files are guaranteed to support pread.
+    if ((fd < 0) || (fstat(fd, &info) == -1) || !S_ISREG(info.st_mode))
+        return NULL;
+    if ((reader = calloc(1, sizeof *reader)) == NULL)
+        return NULL;
+
+    reader->fd = fd;
+    reader->offset = offset;
+    reader->block_size = block_size;
+    reader->state = AHEAD_IDLE;
+    if ((reader->ahead = malloc(block_size)) == NULL)
+        goto fail_buffer;
+    if (pthread_mutex_init(&reader->lock, NULL) != 0)
+        goto fail_lock;
+    if (pthread_cond_init(&reader->changed, NULL) != 0)
+        goto fail_cond;
+    if (pthread_create(&reader->thread, NULL, readahead_main, reader) != 0)
+        goto fail_thread;
+    return reader;
+
+fail_thread:
+    pthread_cond_destroy(&reader->changed);
+fail_cond:
+    pthread_mutex_destroy(&reader->lock);
+fail_lock:
+    free(reader->ahead);
+fail_buffer:
+    free(reader);
+    return NULL;
+}
+
+
+void source_reader_free(source_reader_t *const reader) {
+    if (reader == NULL)
+        return;
+
+    pthread_mutex_lock(&reader->lock);
+    reader->stopping = 1;
+    pthread_cond_broadcast(&reader->changed);
+    pthread_mutex_unlock(&reader->lock);
+    pthread_join(reader->thread, NULL);
+
+    pthread_cond_destroy(&reader->changed);
+    pthread_mutex_destroy(&reader->lock);
+    free(reader->ahead);
+    free(reader);
+}
+
+
+long source_reader_read(source_reader_t *const reader, const ulong block, char *const dest) {
+    long length = -1;
+    int error = 0;
+    int found = 0;
+
+    pthread_mutex_lock(&reader->lock);
+    if (reader->ahead_block == block) {
+        // A request that the thread has not yet picked up is cheaper to serve
+        // directly than to wait for.
+        if (reader->state == AHEAD_WANTED)
+            reader->state = AHEAD_IDLE;
+        while (reader->state == AHEAD_READING)
+            pthread_cond_wait(&reader->changed, &reader->lock);
+        // A failed readahead is retried directly so that the error, if it
+        // persists, is reported with an accurate errno.
+        if ((reader->state == AHEAD_READY) && (reader->ahead_size >= 0)) {
+            length = reader->ahead_size;
+            memcpy(dest, reader->ahead, (size_t) length);
+            found = 1;
+        }
+        if (reader->state == AHEAD_READY)
+            reader->state = AHEAD_IDLE;
+    }
+    pthread_mutex_unlock(&reader->lock);
+
+    if (!found) {
+        length = read_block(reader, block, dest);
+        error = errno;
+    }
+
+    // Anticipate sequential access unless the end of the file was reached.
+    pthread_mutex_lock(&reader->lock);
+    if (((ulong) length == reader->block_size) && (reader->state != AHEAD_READING)) {
+        reader->ahead_block = block + 1;
+        reader->state = AHEAD_WANTED;
+        pthread_cond_broadcast(&reader->changed);
+    }
+    pthread_mutex_unlock(&reader->lock);
+
+    if (length < 0)
+        errno = error;
+    return length;
+}
+
+
+static void *readahead_main(void *arg) {
+    source_reader_t *const reader = (source_reader_t *) arg;
+
+    pthread_mutex_lock(&reader->lock);
+    for (;;) {
+        ulong block;
+        long length;
+
+        while (!reader->stopping && (reader->state != AHEAD_WANTED))
+            pthread_cond_wait(&reader->changed, &reader->lock);
+        if (reader->stopping)
+            break;
+
+        block = reader->ahead_block;
+        reader->state = AHEAD_READING;
+        pthread_mutex_unlock(&reader->lock);
+        length = read_block(reader, block, reader->ahead);
+        pthread_mutex_lock(&reader->lock);
+
+        reader->ahead_size = length;
+        reader->state = AHEAD_READY;
+        pthread_cond_broadcast(&reader->changed);
+    }
+    pthread_mutex_unlock(&reader->lock);
+    return NULL;
+}
+
+
+static long read_block(const source_reader_t *const reader, const ulong block, char *const dest) {
+    const off_t start = reader->offset + (off_t) block * (off_t) reader->block_size;
+    ulong total = 0;
+
+    while (total < reader->block_size) {
+        const ssize_t count = pread(reader->fd, dest + total, reader->block_size - total,
+                start + (off_t) total);
+        if (count > 0)
+            total += (ulong) count;
+        else if (count == 0)
+            break;
+        else if (errno != EINTR)
+            return -1;
+    }
+    return (long) total;
+}
+
+#else
+
+struct source_reader {
+    int unused;
+};
+
+
+source_reader_t *source_reader_init(const int fd, const off_t offset, const ulong block_size) {
+    (void) fd;
+    (void) offset;
+    (void) block_size;
+    return NULL;
+}
+
+
+void source_reader_free(source_reader_t *const reader) {
+    (void) reader;
+}
+
+
+long source_reader_read(source_reader_t *const reader, const ulong block, char *const dest) {
+    (void) reader;
+    (void) block;
+    (void) dest;
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
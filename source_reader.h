@@ -0,0 +1,80 @@
+/* 
+ * File:   source_reader.h
+ * Author: Michael Winter <mail@michael-winter.me.uk>
+ *
+ * Created on 16 October 2026, 10:12
+ */
+
+#ifndef SOURCE_READER_H
+#define	SOURCE_READER_H
+
+#include "config.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+    typedef unsigned long ulong;
+
+    /**
+     * A reader that fetches fixed-size blocks from a file descriptor without
+     * involving the interpreter.
+     * 
+     * Blocks are read with pread, so the file position of the descriptor is
+     * neither used nor modified. Whenever a full block is read, a background
+     * thread reads the following block in anticipation of sequential access,
+     * allowing the caller to process one block while the next is fetched.
+     * 
+     * A reader is not itself thread-safe: only one thread may call
+     * source_reader_read at a time.
+     */
+    typedef struct source_reader source_reader_t;
+
+    /**
+     * Create a reader for the given file descriptor.
+     * 
+     * The descriptor is borrowed and must remain open until the reader is
+     * released.
+     * 
+     * @param fd the file descriptor from which blocks are read. It must refer
+     *           to a regular file.
+     * @param offset the position within the file of the start of block zero
+     *               (0).
+     * @param block_size the size of each block. Cannot be zero (0).
+     * @return the reader on success; NULL if the descriptor is unsuitable,
+     *         there was insufficient memory, or native reading is unavailable
+     *         on this platform.
+     */
+    source_reader_t *source_reader_init(const int fd, const off_t offset, const ulong block_size);
+    /**
+     * Stop the readahead thread and deallocate the reader.
+     * 
+     * @param reader a pointer to the reader to deallocate. May be NULL.
+     */
+    void source_reader_free(source_reader_t *const reader);
+
+    /**
+     * Read a block from the file.
+     * 
+     * If the block was fetched in advance it is copied from the readahead
+     * buffer, waiting for that read to complete if necessary; otherwise, it is
+     * read directly into dest.
+     * 
+     * @param reader a pointer to the reader.
+     * @param block the number of the block to read.
+     * @param dest a pointer to a region of at least block_size bytes into
+     *             which the block is stored.
+     * @return the number of bytes read, which is less than the block size
+     *         only for the last block of the file; -1 on error, with errno set.
+     */
+    long source_reader_read(source_reader_t *const reader, const ulong block, char *const dest);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* SOURCE_READER_H */
@@ -1,6 +1,13 @@
 import io
+import mmap
+import os
+import tempfile
+import threading
 from unittest import TestCase
-from xdelta import DeltaFile
+from django.core.files import File
+from django.core.files.storage import Storage
+from xdelta import DeltaFile, DeltaStorage
+import _xdelta
 
 class DeltaFileTest(TestCase):
     @classmethod
@@ -54,6 +61,36 @@ class DeltaFileTest(TestCase):
         with DeltaFile(self.TARGET) as df:
             self.assertEqual(df.read(), self.DATA)
 
+    def test_can_read_data_into_buffer(self):
+        buffer = bytearray(100)
+        data = bytearray()
+        with DeltaFile(io.BytesIO(self.ENCODED)) as df:
+            while True:
+                count = df.readinto(buffer)
+                if not count:
+                    break
+                data += buffer[:count]
+        self.assertEqual(bytes(data), self.DATA)
+
+    def test_can_read_data_into_mmap(self):
+        region = mmap.mmap(-1, len(self.DATA))
+        with DeltaFile(io.BytesIO(self.ENCODED)) as df:
+            self.assertEqual(df.readinto(region), len(self.DATA))
+        self.assertEqual(region[:], self.DATA)
+        region.close()
+
+    def test_can_read_data_in_small_pieces(self):
+        buffer = bytearray(7)
+        data = b""
+        with DeltaFile(io.BytesIO(self.ENCODED)) as df:
+            while True:
+                piece = df.read(13)
+                count = df.readinto(buffer)
+                data += piece + bytes(buffer[:count])
+                if not piece:
+                    break
+        self.assertEqual(data, self.DATA)
+
     def test_can_write_and_read_data(self):
         with DeltaFile(self.file) as df:
             df.write(self.DATA)
@@ -85,3 +122,584 @@ class DeltaFileTest(TestCase):
             df.read()
             with self.assertRaises(AttributeError):
                 df.source = self.SOURCE
+
+    def test_can_write_buffers(self):
+        region = mmap.mmap(-1, len(self.DATA))
+        region.write(self.DATA)
+        for content in (bytearray(self.DATA), memoryview(self.DATA), region):
+            output = io.BytesIO()
+            with DeltaFile(output) as df:
+                df.write(content)
+                df.flush()
+                self.assertEqual(output.getvalue(), self.ENCODED)
+        # The content of a mapping is copied, so it may be closed before it is encoded.
+        output = io.BytesIO()
+        with DeltaFile(output) as df:
+            df.write(region)
+            region.close()
+            df.flush()
+            self.assertEqual(output.getvalue(), self.ENCODED)
+
+    def test_can_use_file_as_source(self):
+        source = os.urandom(5 * 2**20)
+        data = source[:3 * 2**20] + self.DATA + source[3 * 2**20:]
+        with tempfile.TemporaryFile() as source_file:
+            source_file.write(b"header" + source)
+            source_file.seek(len(b"header"))
+            with DeltaFile(self.file) as df:
+                df.source = source_file
+                df.write(data)
+                df.flush()
+                self.assertLess(df.size, len(self.DATA))
+                source_file.seek(len(b"header"))
+                df.open('rb')
+                df.source = source_file
+                self.assertEqual(df.read(), data)
+
+    def test_reads_only_required_source_blocks(self):
+        class CountingBytesIO(io.BytesIO):
+            count = 0
+
+            def read(self, size=-1):
+                data = io.BytesIO.read(self, size)
+                self.count += len(data)
+                return data
+
+        source = os.urandom(8 * 2**20)
+        data = source[-2**20:]
+        with DeltaFile(self.file) as df:
+            df.source = io.BytesIO(source)
+            df.write(data)
+            df.flush()
+            df.open('rb')
+            df.source = CountingBytesIO(source)
+            self.assertEqual(df.read(), data)
+            self.assertLessEqual(df.source.count, 2 * 2**20)
+
+    def test_can_tune_encoding(self):
+        for options in ({'level': 0}, {'level': 1, 'secondary': 'none'}, {'matcher': 'fast', 'secondary': 'fgk'},
+                        {'winsize': 2**16, 'source_winsize': 2**20, 'cache_blocks': 4}):
+            output = io.BytesIO()
+            with DeltaFile(output, **options) as df:
+                df.source = io.BytesIO(self.SOURCE.getvalue())
+                df.write(self.DATA * 200)
+                df.flush()
+                df.open('rb')
+                df.source = io.BytesIO(self.SOURCE.getvalue())
+                self.assertEqual(df.read(), self.DATA * 200)
+
+    def test_cannot_use_invalid_tuning(self):
+        for options in ({'level': 10}, {'matcher': 'fastidious'}, {'secondary': 'lzma'}, {'cache_blocks': 0},
+                        {'cache_policy': 'mru'}, {'compressed_cache': -1},
+                        {'source_key': 'shared', 'cache_policy': '2q'},
+                        {'source_key': 'shared', 'compressed_cache': 2**20}):
+            with self.assertRaises(ValueError):
+                with DeltaFile(self.file, **options) as df:
+                    df.write(self.DATA)
+
+    def test_reads_evicted_source_blocks_again(self):
+        source = os.urandom(2**20)
+        data = source[2**19:] + source[:2**19]
+        with DeltaFile(self.file) as df:
+            df.source = io.BytesIO(source)
+            df.write(data)
+            df.flush()
+            self.assertLess(df.size, len(data) // 10)
+            encoded = self.file.getvalue()
+        with DeltaFile(io.BytesIO(encoded), source_winsize=2**18, cache_blocks=4) as df:
+            df.source = io.BytesIO(source)
+            self.assertEqual(df.read(), data)
+
+    def test_reports_failure_to_seek_source(self):
+        class Source(io.BytesIO):
+            broken = False
+
+            def seek(self, *args):
+                if self.broken:
+                    raise IOError('cannot seek')
+                return io.BytesIO.seek(self, *args)
+
+        source = os.urandom(2**20)
+        data = source[2**19:] + source[:2**19]
+        encoded = _xdelta.encode(data, source)
+        with DeltaFile(io.BytesIO(encoded), source_winsize=2**18, cache_blocks=4) as df:
+            df.source = stream = Source(source)
+            stream.broken = True
+            with self.assertRaisesRegexp(IOError, 'cannot seek'):
+                df.read()
+
+    def test_can_use_many_small_source_blocks(self):
+        source = os.urandom(4 * 2**20)
+        pieces = [source[i:i + 2**15] for i in range(0, len(source), 2**15)]
+        data = b''.join(pieces[i * 37 % len(pieces)] for i in range(len(pieces)))
+        with DeltaFile(self.file, source_winsize=2**23, cache_blocks=512) as df:
+            df.source = io.BytesIO(source)
+            df.write(data)
+            df.flush()
+            self.assertLess(df.size, len(data) // 10)
+            encoded = self.file.getvalue()
+        with DeltaFile(io.BytesIO(encoded), source_winsize=2**21, cache_blocks=128) as df:
+            df.source = io.BytesIO(source)
+            self.assertEqual(df.read(), data)
+
+    def test_keeps_hot_source_blocks_through_scans(self):
+        size = 2**14
+        source = os.urandom(128 * size)
+        parts = []
+        for r in range(40):
+            blocks = list(range(4)) + [4 + (r * 5 + i) % 120 for i in range(5)]
+            if r % 4 == 3:
+                blocks += range(28, 128)
+            parts.extend(source[b * size + r * 300:b * size + r * 300 + 1000] for b in blocks)
+        data = b''.join(parts)
+        encoded = _xdelta.encode(data, source)
+        ratios = {}
+        for policy in ('lru', '2q'):
+            with DeltaFile(io.BytesIO(encoded), source_winsize=32 * size, cache_blocks=32, cache_policy=policy) as df:
+                df.source = io.BytesIO(source)
+                self.assertEqual(df.read(), data)
+                ratios[policy] = df.stats['cache_hit_ratio']
+        self.assertGreater(ratios['2q'], ratios['lru'] * 1.5)
+
+    def test_keeps_evicted_source_blocks_compressed(self):
+        source = b''.join(b'line %d of some text %s\n' % (i, os.urandom(4).encode('hex')) for i in range(20000))
+        pieces = [source[i:i + 2**13] for i in range(0, len(source), 2**13)]
+        data = b''.join(pieces[i * 37 % len(pieces)] for i in range(len(pieces)))
+        encoded = _xdelta.encode(data, source)
+        blocks_read = {}
+        for capacity in (0, 2**20):
+            with DeltaFile(io.BytesIO(encoded), source_winsize=2**18, cache_blocks=4, compressed_cache=capacity) as df:
+                df.source = io.BytesIO(source)
+                self.assertEqual(df.read(), data)
+                blocks_read[capacity] = df.stats['blocks_read']
+                self.assertEqual(df.stats['compressed_hits'] > 0, capacity > 0)
+        self.assertLess(blocks_read[2**20], blocks_read[0] // 2)
+
+    def test_sizes_source_cache_to_source(self):
+        stream = _xdelta.Stream()
+        self.assertEqual(stream.block_size, 2**21)
+        stream.source = io.BytesIO(b'x' * 10000)
+        self.assertEqual(stream.block_size, 2**14)
+        stream.source = io.BytesIO(b'x' * 2**27)
+        self.assertEqual(stream.block_size, 2**21)
+
+    def test_shares_cache_budget(self):
+        source = os.urandom(2**20)
+        data = source[2**19:] + source[:2**19]
+        _xdelta.set_cache_budget(1)
+        try:
+            with DeltaFile(self.file, source_winsize=2**20, cache_blocks=16) as df:
+                df.source = io.BytesIO(source)
+                df.write(data)
+                df.flush()
+                df.open('rb')
+                df.source = io.BytesIO(source)
+                self.assertEqual(df.read(), data)
+                usage = _xdelta.cache_usage()
+                self.assertEqual(usage['budget'], 1)
+                self.assertLessEqual(usage['allocated'], 2**21)
+        finally:
+            _xdelta.set_cache_budget(0)
+
+    def test_shares_source_blocks_between_streams(self):
+        source = os.urandom(2**20)
+        data = source[2**19:] + source[:2**19]
+        encoded = _xdelta.encode(data, source)
+
+        def decode(source_file, **options):
+            with DeltaFile(io.BytesIO(encoded), **options) as df:
+                df.source = source_file
+                self.assertEqual(df.read(), data)
+                return df.stats['blocks_read']
+
+        with tempfile.NamedTemporaryFile() as source_file:
+            source_file.write(source)
+            source_file.flush()
+            with open(source_file.name, 'rb') as first, open(source_file.name, 'rb') as second:
+                self.assertGreater(decode(first), 0)
+                self.assertGreater(decode(second), 0)
+        self.assertGreater(decode(io.BytesIO(source), source_key='shared'), 0)
+        self.assertEqual(decode(io.BytesIO(source), source_key='shared'), 0)
+        self.assertGreater(_xdelta.cache_usage()['shared_allocated'], 0)
+        _xdelta.set_cache_budget(1)
+        try:
+            self.assertGreater(decode(io.BytesIO(source), source_key='budgeted'), 0)
+            usage = _xdelta.cache_usage()
+            self.assertLessEqual(usage['shared_allocated'], 2**16)
+            self.assertEqual(usage['allocated'], usage['shared_allocated'])
+        finally:
+            _xdelta.set_cache_budget(0)
+
+    def test_reports_stats(self):
+        source = self.SOURCE.getvalue()
+        with DeltaFile(self.file) as df:
+            df.source = io.BytesIO(source)
+            df.write(self.DATA)
+            df.flush()
+            stats = df.stats
+            self.assertEqual(stats['bytes_in'], len(self.DATA))
+            self.assertEqual(stats['bytes_out'], df.size)
+            self.assertEqual(stats['windows'], 1)
+            self.assertGreaterEqual(stats['blocks_read'], 1)
+            self.assertGreater(stats['engine_time'], 0)
+            encoded = self.file.getvalue()
+        with DeltaFile(io.BytesIO(encoded)) as df:
+            df.source = io.BytesIO(source)
+            df.read(1)
+            self.assertEqual(df.stats['bytes_out'], 1)
+            self.assertEqual(df.stats['spill_bytes'], len(self.DATA) - 1)
+            self.assertEqual(df.read(), self.DATA[1:])
+            self.assertEqual(df.stats['bytes_in'], len(encoded))
+            self.assertEqual(df.stats['bytes_out'], len(self.DATA))
+            self.assertEqual(df.stats['cache_misses'], df.stats['blocks_read'])
+        with DeltaFile(io.BytesIO(encoded)) as df:
+            df.source = io.BytesIO(source)
+            self.assertEqual(b''.join(iter(lambda: df.read(1), b'')), self.DATA)
+            self.assertEqual(df.stats['spill_bytes'], len(self.DATA) - 1)
+
+    def test_reports_decoded_size_without_decoding(self):
+        with DeltaFile(self.file, winsize=2**14) as df:
+            df.write(self.DATA * 100)
+            df.flush()
+            self.assertEqual(df.decoded_size, len(self.DATA) * 100)
+            df.write(self.DATA)
+            df.flush()
+            self.assertEqual(df.decoded_size, len(self.DATA) * 101)
+            encoded = self.file.getvalue()
+        with DeltaFile(io.BytesIO(encoded)) as df:
+            self.assertEqual(df.decoded_size, len(self.DATA) * 101)
+            self.assertTrue(df.multiple_chunks(len(self.DATA) * 100))
+            self.assertFalse(df.multiple_chunks(len(self.DATA) * 101))
+            self.assertIsNone(df.stats)
+        with DeltaFile(io.BytesIO(self.ENCODED)) as df:
+            self.assertEqual(df.decoded_size, len(self.DATA))
+
+    def test_can_size_empty_and_unfinished_files(self):
+        with DeltaFile(io.BytesIO()) as df:
+            self.assertEqual(df.decoded_size, 0)
+            self.assertFalse(df.multiple_chunks())
+        with DeltaFile(io.BytesIO(self.ENCODED[:3])) as df:
+            with self.assertRaises(IOError):
+                df.decoded_size
+            self.assertFalse(df.multiple_chunks())
+        with DeltaFile(self.file) as df:
+            df.write(self.DATA * 100)
+            self.assertFalse(df.multiple_chunks())
+
+    def test_can_iterate_over_windows(self):
+        data = os.urandom(5000) + self.DATA * 300
+        with DeltaFile(self.file, winsize=2**15) as df:
+            df.write(data)
+            df.flush()
+            df.open('rb')
+            chunks = list(df.chunks(2**20))
+            self.assertEqual([len(chunk) for chunk in chunks], [2**15] * (len(data) // 2**15) + [len(data) % 2**15])
+            self.assertEqual(b"".join(chunks), data)
+            self.assertEqual(df.tell(), len(data))
+            chunks = list(df.chunks(10000))
+            self.assertEqual(max(len(chunk) for chunk in chunks), 10000)
+            self.assertTrue(all(isinstance(chunk, bytes) for chunk in chunks))
+            self.assertEqual(b"".join(chunks), data)
+            windows = []
+            for window in df.iter_windows():
+                self.assertIsInstance(window, memoryview)
+                windows.append(window.tobytes())
+                del window
+            self.assertEqual(windows, [chunk for chunk in df.chunks(2**20)])
+            with self.assertRaises(BufferError):
+                list(df.iter_windows())
+            df.open('rb')
+            df.read(100)
+            windows = []
+            for window in df._stream.iter_windows():
+                windows.append(window.tobytes())
+                del window
+            self.assertEqual(b"".join(windows), data[100:])
+        with DeltaFile(io.BytesIO(self.ENCODED)) as df:
+            df.source = self.SOURCE
+            self.assertEqual(b"".join(df), self.DATA)
+            self.assertEqual(len(list(df)), 1)
+
+    def test_can_seek_and_read_ranges(self):
+        source = os.urandom(2**18)
+        data = source[1000:] + os.urandom(50000) + source[:5000]
+        with DeltaFile(self.file, winsize=2**15) as df:
+            df.source = io.BytesIO(source)
+            df.write(data)
+            df.flush()
+            encoded = self.file.getvalue()
+        with DeltaFile(io.BytesIO(encoded)) as df:
+            df.source = io.BytesIO(source)
+            self.assertTrue(df.seekable())
+            self.assertEqual(df.read(100), data[:100])
+            self.assertEqual(df.tell(), 100)
+            self.assertEqual(df.seek(200000), 200000)
+            self.assertEqual(df.read(70000), data[200000:270000])
+            self.assertEqual(df.tell(), 270000)
+            self.assertEqual(df.seek(-10, io.SEEK_CUR), 269990)
+            self.assertEqual(df.read(20), data[269990:270010])
+            self.assertEqual(df.read_range(32768, 32868), data[32768:32868])
+            self.assertEqual(df.read_range(5, 10), data[5:10])
+            self.assertEqual(df.seek(-5000, io.SEEK_END), len(data) - 5000)
+            self.assertEqual(df.read(), data[-5000:])
+            df.seek(len(data) + 10)
+            self.assertEqual(df.read(), b"")
+            df.seek(0)
+            self.assertEqual(df.read(), data)
+
+    def test_can_embed_window_index(self):
+        class CountingBytesIO(io.BytesIO):
+            count = 0
+
+            def read(self, size=-1):
+                self.count += 1
+                return io.BytesIO.read(self, size)
+
+        source = os.urandom(2**18)
+        data = source[1000:] + os.urandom(50000) + source[:5000]
+        with DeltaFile(self.file, winsize=2**15, index=True) as df:
+            df.source = io.BytesIO(source)
+            df.write(data[:100000])
+            df.flush()
+            df.write(data[100000:])
+            df.flush()
+            encoded = self.file.getvalue()
+        self.assertEqual(_xdelta.decode(encoded, source), data)
+        delta = CountingBytesIO(encoded)
+        header, windows = _xdelta.scan_windows(delta)
+        self.assertLessEqual(delta.count, 5)
+        self.assertEqual(len(windows), 11)
+        self.assertEqual(windows[4][1:], (100000, 2**15))
+        self.assertEqual(sum(length for _, _, length in windows), len(data))
+        with DeltaFile(io.BytesIO(encoded)) as df:
+            df.source = io.BytesIO(source)
+            self.assertEqual(df.read_range(200000, 270000), data[200000:270000])
+            df.seek(0)
+            self.assertEqual(df.read(), data)
+
+    def test_can_encode_and_decode_in_steps(self):
+        source = os.urandom(2**17)
+        data = source[5000:] + os.urandom(20000) + source[:3000]
+
+        def run(step, stream, chunks):
+            output = []
+            for chunk in chunks:
+                result, block = step(chunk)
+                output.append(result)
+                while block is not None:
+                    size = stream.block_size
+                    stream.supply_block(block, source[block * size:(block + 1) * size])
+                    result, block = step()
+                    output.append(result)
+            return b"".join(output)
+
+        encoder = _xdelta.Stream(winsize=2**15, source_winsize=2**16, cache_blocks=4)
+        encoder.source = io.BytesIO()
+        chunks = [data[i:i + 10000] for i in range(0, len(data), 10000)]
+        encoded = run(encoder.encode_step, encoder, chunks)
+        encoded += run(lambda content=None: encoder.encode_step(content, flush=True), encoder,
+                       [None])
+        self.assertEqual(_xdelta.decode(encoded, source), data)
+        self.assertLess(len(encoded), len(data) // 2)
+        decoder = _xdelta.Stream(source_winsize=2**16, cache_blocks=4)
+        decoder.source = io.BytesIO()
+        decoder.supply_block(0, source[:decoder.block_size])
+        chunks = [encoded[i:i + 1000] for i in range(0, len(encoded), 1000)]
+        self.assertEqual(run(decoder.decode_step, decoder, chunks), data)
+        self.assertEqual(decoder.stats['blocks_read'], 0)
+        with self.assertRaises(ValueError):
+            decoder.supply_block(0, b"x" * (decoder.block_size + 1))
+
+    def test_can_encode_and_decode_in_memory(self):
+        source = self.SOURCE.getvalue()
+        self.assertEqual(_xdelta.decode(self.ENCODED), self.DATA)
+        self.assertEqual(_xdelta.decode(_xdelta.encode(self.DATA)), self.DATA)
+        self.assertEqual(_xdelta.decode(_xdelta.encode(b"")), b"")
+        delta = _xdelta.encode(bytearray(self.DATA), source, level=1, secondary='none')
+        self.assertEqual(_xdelta.decode(delta, bytearray(source)), self.DATA)
+        data = os.urandom(2**20)
+        self.assertEqual(_xdelta.decode(_xdelta.encode(data, source), source), data)
+        with self.assertRaises(IOError):
+            _xdelta.decode(self.DATA)
+
+    def test_finds_matches_ending_anywhere(self):
+        source = os.urandom(2**14)
+        for end in list(range(60, 100)) + [4095, 4096, 4097]:
+            data = bytearray(source[:4200])
+            data[end] ^= 0xff
+            data = bytes(data + data[:end] + b'x')
+            delta = _xdelta.encode(data, source)
+            self.assertLess(len(delta), len(data) // 2)
+            self.assertEqual(_xdelta.decode(delta, source), data)
+
+    def test_finds_matches_starting_anywhere(self):
+        # With 16 KB blocks in a 256 KB window, the source past the window is only indexed once the target passes
+        # 128 KB. A copy of it placed so that target offset 128 KB falls offset bytes into the block at 272 KB is found
+        # there, and extends back over the given span: to a mismatch within the first offset bytes, so that short
+        # comparisons of every alignment end in the tails of the kernels, or across into the block before.
+        source = os.urandom(2**19)
+        for offset in range(71):
+            for span in (offset // 2, 2**14 - offset):
+                start = 17 * 2**14 + offset - span
+                head = os.urandom(2**17 - span)
+                data = head + source[start:start + 2**15]
+                encoded = io.BytesIO()
+                with DeltaFile(encoded, source_winsize=2**18, cache_blocks=16) as df:
+                    df.source = io.BytesIO(source)
+                    df.write(data)
+                    df.flush()
+                    self.assertLess(len(encoded.getvalue()), len(head) + 100)
+                    df.open('rb')
+                    df.source = io.BytesIO(source)
+                    self.assertEqual(df.read(), data)
+
+    def test_can_merge_deltas(self):
+        versions = [os.urandom(2**17)]
+        for i in range(3):
+            previous = versions[-1]
+            versions.append(previous[:1000 * i] + os.urandom(500) + previous[5000:] + self.DATA)
+        deltas = [_xdelta.encode(versions[i + 1], versions[i]) for i in range(3)]
+        merged = _xdelta.merge(deltas)
+        self.assertEqual(_xdelta.decode(merged, versions[0]), versions[-1])
+        self.assertLess(len(merged), len(versions[-1]) // 10)
+        self.assertEqual(_xdelta.decode(_xdelta.merge(deltas[:1], secondary='none'), versions[0]),
+                         versions[1])
+        with self.assertRaises(ValueError):
+            _xdelta.merge([])
+        with self.assertRaises(IOError):
+            _xdelta.merge([deltas[0], deltas[1][:100]])
+
+    def test_can_encode_and_decode_many(self):
+        source = self.SOURCE.getvalue()
+        targets = [self.DATA, b"", os.urandom(2**16), self.DATA * 64]
+        deltas = _xdelta.encode_many([(target, source) for target in targets], threads=3)
+        self.assertEqual(deltas, [_xdelta.encode(target, source) for target in targets])
+        pairs = [(delta, source) for delta in deltas]
+        self.assertEqual(_xdelta.decode_many(pairs), targets)
+        self.assertEqual(_xdelta.decode_many([(self.ENCODED, None)], threads=1), [self.DATA])
+        self.assertEqual(_xdelta.decode_many([(self.ENCODED, None)] * 64, threads=10000), [self.DATA] * 64)
+        self.assertEqual(_xdelta.encode_many([]), [])
+        with self.assertRaises(TypeError):
+            _xdelta.encode_many([self.DATA])
+        with self.assertRaises(IOError):
+            _xdelta.decode_many([(self.ENCODED, None), (self.DATA, None)])
+
+    def test_can_encode_and_decode_concurrently(self):
+        results = [None] * 4
+
+        def round_trip(index):
+            output = io.BytesIO()
+            with DeltaFile(output) as df:
+                df.write(self.DATA * 64)
+                df.flush()
+                df.open('rb')
+                results[index] = df.read()
+
+        threads = [threading.Thread(target=round_trip, args=(i,)) for i in range(len(results))]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEqual(results, [self.DATA * 64] * len(results))
+
+
+class MemoryStorage(Storage):
+    def __init__(self):
+        self.files = {}
+        self.opened = 0
+
+    def _open(self, name, mode='rb'):
+        self.opened += 1
+        return File(io.BytesIO(self.files[name]), name)
+
+    def _save(self, name, content):
+        self.files[name] = b"".join(content.chunks())
+        return name
+
+    def exists(self, name):
+        return name in self.files or any(path.startswith(name + '/') for path in self.files)
+
+    def delete(self, name):
+        del self.files[name]
+
+    def listdir(self, path):
+        return [], [name[len(path) + 1:] for name in self.files if name.startswith(path + '/')]
+
+    def size(self, name):
+        return len(self.files[name])
+
+
+class DeltaStorageTest(TestCase):
+    def setUp(self):
+        self.backing = MemoryStorage()
+        base = os.urandom(2**16)
+        self.revisions = [base[:1000 * i] + os.urandom(100) + base[1000 * i:] for i in range(7)]
+
+    def save_all(self, storage):
+        for data in self.revisions:
+            self.assertEqual(storage.save('doc.txt', File(io.BytesIO(data))), 'doc.txt')
+
+    def test_stores_keyframes_and_deltas(self):
+        storage = DeltaStorage(self.backing, keyframe_interval=3, cache_size=0)
+        self.save_all(storage)
+        self.assertEqual(sorted(self.backing.files), ['doc.txt.revisions/0000000{0}.{1}'.format(
+            i, 'key' if i % 3 == 0 else 'delta') for i in range(7)])
+        self.assertLess(self.backing.size('doc.txt.revisions/00000002.delta'), 1000)
+        self.assertEqual(storage.revisions('doc.txt'), 7)
+        for i, data in enumerate(self.revisions):
+            self.backing.opened = 0
+            with storage.open_revision('doc.txt', i) as f:
+                self.assertEqual(f.read(), data)
+            self.assertEqual(self.backing.opened, i % 3 + 1)
+        with storage.open('doc.txt') as f:
+            self.assertEqual(f.read(), self.revisions[-1])
+        self.assertEqual(storage.size('doc.txt'), len(self.revisions[-1]))
+        with self.assertRaises(IOError):
+            storage.open_revision('doc.txt', 7)
+
+    def test_reads_from_cached_revisions(self):
+        storage = DeltaStorage(self.backing, keyframe_interval=10, cache_size=2)
+        self.save_all(storage)
+        self.backing.opened = 0
+        with storage.open('doc.txt') as f:
+            self.assertEqual(f.read(), self.revisions[-1])
+        with storage.open_revision('doc.txt', 5) as f:
+            self.assertEqual(f.read(), self.revisions[5])
+        self.assertEqual(self.backing.opened, 0)
+        with storage.open_revision('doc.txt', 2) as f:
+            self.assertEqual(f.read(), self.revisions[2])
+        self.assertEqual(self.backing.opened, 3)
+
+    def test_stores_keyframe_after_threshold(self):
+        storage = DeltaStorage(self.backing, keyframe_threshold=1, secondary='none')
+        self.save_all(storage)
+        self.assertTrue(all(name.endswith('.key') == (i % 2 == 0)
+                            for i, name in enumerate(sorted(self.backing.files))))
+        self.assertTrue(storage.exists('doc.txt'))
+        storage.delete('doc.txt')
+        self.assertFalse(storage.exists('doc.txt'))
+        self.assertEqual(self.backing.files, {})
+
+    def test_rejects_concurrently_saved_revision(self):
+        storage = DeltaStorage(self.backing)
+        storage.save('doc.txt', File(io.BytesIO(self.revisions[0])))
+        # As if another save had stored the first revision after this one listed the revisions.
+        listdir, self.backing.listdir = self.backing.listdir, lambda path: ([], [])
+        with self.assertRaises(IOError):
+            storage.save('doc.txt', File(io.BytesIO(self.revisions[1])))
+        self.backing.listdir = listdir
+        self.assertEqual(list(self.backing.files), ['doc.txt.revisions/00000000.key'])
+        with storage.open('doc.txt') as f:
+            self.assertEqual(f.read(), self.revisions[0])
+
+    def test_saves_delta_files(self):
+        storage = DeltaStorage(self.backing, keyframe_interval=3)
+        for data in self.revisions:
+            encoded = io.BytesIO()
+            with DeltaFile(encoded, winsize=2**15) as df:
+                df.write(data)
+                df.flush()
+                self.assertEqual(storage.save('doc.txt', DeltaFile(io.BytesIO(encoded.getvalue()))), 'doc.txt')
+            with storage.open('doc.txt') as f:
+                self.assertEqual(f.read(), data)
+        self.assertEqual(storage.revisions('doc.txt'), len(self.revisions))
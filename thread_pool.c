@@ -0,0 +1,98 @@
+
+#include "thread_pool.h"
+
+#if HAVE_PTHREAD
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+typedef struct {
+#if HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+    ulong next;
+    ulong count;
+    thread_pool_func func;
+    void *context;
+} pool;
+
+#if HAVE_PTHREAD
+static void *pool_main(void *);
+static int   claim_item(pool *const, ulong *const);
+#endif
+
+
+void thread_pool_run(ulong threads, const ulong count, thread_pool_func func,
+                     void *const context) {
+    pool work;
+    work.next = 0;
+    work.count = count;
+    work.func = func;
+    work.context = context;
+
+    // Each thread runs its own engine, so more threads than processors would
+    // only add memory.
+    if ((threads == 0) || (threads > thread_pool_cpu_count()))
+        threads = thread_pool_cpu_count();
+    if (threads > count)
+        threads = count;
+
+#if HAVE_PTHREAD
+    if ((threads > 1) && (pthread_mutex_init(&work.lock, NULL) == 0)) {
+        pthread_t *const workers = malloc((threads - 1) * sizeof *workers);
+        ulong started = 0;
+
+        if (workers != NULL)
+            for (; started < threads - 1; started++)
+                if (pthread_create(&workers[started], NULL, pool_main, &work) != 0)
+                    break;
+        pool_main(&work);
+        while (started > 0)
+            pthread_join(workers[--started], NULL);
+
+        free(workers);
+        pthread_mutex_destroy(&work.lock);
+        return;
+    }
+    // Without a lock, the calling thread must process everything alone.
+    threads = 1;
+#endif
+    (void) threads;
+    for (; work.next < count; work.next++)
+        func(context, work.next);
+}
+
+
+ulong thread_pool_cpu_count(void) {
+#if HAVE_PTHREAD && defined(_SC_NPROCESSORS_ONLN)
+    const long count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count > 0)
+        return (ulong) count;
+#endif
+    return 1;
+}
+
+
+#if HAVE_PTHREAD
+
+static void *pool_main(void *arg) {
+    pool *const work = (pool *) arg;
+    ulong index;
+
+    while (claim_item(work, &index))
+        work->func(work->context, index);
+    return NULL;
+}
+
+
+static int claim_item(pool *const work, ulong *const index) {
+    int claimed;
+    pthread_mutex_lock(&work->lock);
+    claimed = work->next < work->count;
+    if (claimed)
+        *index = work->next++;
+    pthread_mutex_unlock(&work->lock);
+    return claimed;
+}
+
+#endif
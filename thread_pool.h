@@ -0,0 +1,63 @@
+/* 
+ * File:   thread_pool.h
+ * Author: Michael Winter <mail@michael-winter.me.uk>
+ *
+ * Created on 16 October 2026, 14:37
+ */
+
+#ifndef THREAD_POOL_H
+#define	THREAD_POOL_H
+
+#include "config.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+    typedef unsigned long ulong;
+
+    /**
+     * A unit of work run by the pool.
+     * 
+     * @param context the context pointer passed to thread_pool_run.
+     * @param index the index of the item to process, from zero (0) to one less
+     *              than the number of items.
+     */
+    typedef void (*thread_pool_func)(void *context, const ulong index);
+
+    /**
+     * Process a number of independent items in parallel.
+     * 
+     * Items are claimed in order by up to the given number of threads, one of
+     * which is the calling thread. The function returns once every item has
+     * been processed. If threads cannot be created, or are unavailable on this
+     * platform, the remaining threads (ultimately the calling thread alone)
+     * process all of the items.
+     * 
+     * The work function must not use the Python interpreter.
+     * 
+     * @param threads the maximum number of threads to use. If zero (0), or
+     *                greater than the number of online processors, that
+     *                number is used.
+     * @param count the number of items to process.
+     * @param func the function that processes each item.
+     * @param context a pointer passed to each invocation of func.
+     */
+    void thread_pool_run(ulong threads, const ulong count, thread_pool_func func,
+                         void *const context);
+
+    /**
+     * Return the number of online processors.
+     * 
+     * @return the number of processors, or one (1) if it cannot be determined.
+     */
+    ulong thread_pool_cpu_count(void);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* THREAD_POOL_H */
@@ -0,0 +1,350 @@
+#include "window_index.h"
+#include <errno.h>
+#include <string.h>
+
+/* Values from RFC 3284. */
+#define MAGIC_SIZE    4
+#define HDR_SECONDARY 0x01
+#define HDR_CODETABLE 0x02
+#define HDR_APPHEADER 0x04
+#define HDR_INVALID   (~0x07)
+#define WIN_SOURCE    0x01
+#define WIN_TARGET    0x02
+#define WIN_INVALID   (~0x07)
+
+/* The longest possible file header before any application data, and the
+ * longest possible window header up to and including the target window
+ * length: an indicator followed by, at most, two 64-bit and two 32-bit
+ * integers. */
+#define MAX_FILE_HEADER   (MAGIC_SIZE + 2 + 5)
+#define MAX_WINDOW_HEADER (1 + 10 + 10 + 5 + 5)
+
+/* The longest header of an index window, which has no source segment and an
+ * empty target and address section, and the longest encoding of a window
+ * within the index. */
+#define MAX_INDEX_HEADER  (1 + 5 + 1 + 1 + 5 + 5 + 1)
+#define MAX_INDEX_ENTRY   (10 + 5 + 10 + 5)
+
+static const uint8_t magic[MAGIC_SIZE] = {0xd6, 0xc3, 0xc4, 0x00};
+static const uint8_t index_tag[WINDOW_INDEX_LOCATOR_OFFSET] = {'x', 'd', 'e', 'l', 't', 'a',
+        'i', '1'};
+
+static int read_embedded(window_index_t *const index, window_read_func read,
+                         void *const context, xoff_t *const offset);
+static int read_integer(const uint8_t **const position, const uint8_t *const end,
+                        const int max_bytes, xoff_t *const value);
+static uint8_t *write_integer(uint8_t *dest, const xoff_t value);
+
+
+int window_index_scan(window_index_t *const index, window_read_func read,
+        void *const context) {
+    uint8_t buffer[MAX_WINDOW_HEADER];
+    const uint8_t *position = buffer;
+    const uint8_t *end;
+    xoff_t offset;
+    xoff_t target_offset = 0;
+    xoff_t value;
+    xoff_t appheader = 0;
+    long length;
+    
+    memset(index, 0, sizeof *index);
+    if ((length = read(context, 0, buffer, MAX_FILE_HEADER)) < 0)
+        return XD3_INTERNAL;
+    end = buffer + length;
+    if ((length < MAGIC_SIZE + 1) || (memcmp(buffer, magic, MAGIC_SIZE) != 0))
+        return XD3_INVALID_INPUT;
+    position += MAGIC_SIZE + 1;
+    if (buffer[MAGIC_SIZE] & HDR_INVALID)
+        return XD3_INVALID_INPUT;
+    if (buffer[MAGIC_SIZE] & HDR_CODETABLE)
+        return XD3_UNIMPLEMENTED;
+    if ((buffer[MAGIC_SIZE] & HDR_SECONDARY) && (position++ == end))
+        return XD3_INVALID_INPUT;
+    offset = position - buffer;
+    if (buffer[MAGIC_SIZE] & HDR_APPHEADER) {
+        if (!read_integer(&position, end, 5, &value))
+            return XD3_INVALID_INPUT;
+        if (value == WINDOW_INDEX_APPHEADER_SIZE)
+            appheader = position - buffer;
+        offset = (position - buffer) + value;
+    }
+    
+    // The header is kept so that decoding can begin at any window.
+    index->header_size = (usize_t) offset;
+    if ((index->header = malloc(index->header_size)) == NULL)
+        return ENOMEM;
+    if ((length = read(context, 0, index->header, index->header_size)) < 0)
+        return XD3_INTERNAL;
+    if ((usize_t) length < index->header_size)
+        return XD3_INVALID_INPUT;
+    if ((appheader != 0) && (memcmp(index->header + appheader, index_tag,
+            WINDOW_INDEX_LOCATOR_OFFSET) == 0)) {
+        int i;
+        value = 0;
+        for (i = WINDOW_INDEX_LOCATOR_OFFSET; i < WINDOW_INDEX_APPHEADER_SIZE; i++)
+            value = (value << 8) | index->header[appheader + i];
+        if (value != 0) {
+            // An embedded index that cannot be read is ignored in favour of
+            // scanning the windows.
+            const int ret = read_embedded(index, read, context, &value);
+            if ((ret == XD3_INTERNAL) || (ret == ENOMEM))
+                return ret;
+            if (ret == 0) {
+                offset = value;
+                if (index->count > 0)
+                    target_offset = index->windows[index->count - 1].target_offset
+                            + index->windows[index->count - 1].target_length;
+            } else
+                index->count = 0;
+        }
+    }
+    
+    for (;;) {
+        window_entry_t entry = {0};
+        uint8_t indicator;
+        const uint8_t *encoding;
+        xoff_t encoding_length;
+        int ret;
+        
+        if ((length = read(context, offset, buffer, MAX_WINDOW_HEADER)) < 0)
+            return XD3_INTERNAL;
+        if (length == 0)
+            break;
+        position = buffer;
+        end = buffer + length;
+        indicator = *position++;
+        if (indicator & WIN_INVALID)
+            return XD3_INVALID_INPUT;
+        if (indicator & WIN_TARGET)
+            return XD3_UNIMPLEMENTED;
+        if (indicator & WIN_SOURCE) {
+            if (!read_integer(&position, end, 5, &value) || (value > (usize_t) -1))
+                return XD3_INVALID_INPUT;
+            entry.source_length = (usize_t) value;
+            if (!read_integer(&position, end, 10, &entry.source_offset))
+                return XD3_INVALID_INPUT;
+        }
+        if (!read_integer(&position, end, 5, &encoding_length))
+            return XD3_INVALID_INPUT;
+        encoding = position;
+        if (!read_integer(&position, end, 5, &value) || (value > XD3_HARDMAXWINSIZE))
+            return XD3_INVALID_INPUT;
+        
+        entry.delta_offset = offset;
+        entry.target_offset = target_offset;
+        entry.target_length = (usize_t) value;
+        if ((ret = window_index_append(index, &entry)) != 0)
+            return ret;
+        // The encoding length counts everything after itself, starting with
+        // the target window length.
+        offset += (xoff_t) (encoding - buffer) + encoding_length;
+        target_offset += entry.target_length;
+    }
+    return 0;
+}
+
+
+int window_index_append(window_index_t *const index, const window_entry_t *const entry) {
+    if (index->count == index->capacity) {
+        const ulong capacity = (index->capacity != 0) ? index->capacity * 2 : 16;
+        window_entry_t *const windows = realloc(index->windows, capacity * sizeof *windows);
+        if (windows == NULL)
+            return ENOMEM;
+        index->windows = windows;
+        index->capacity = capacity;
+    }
+    index->windows[index->count++] = *entry;
+    return 0;
+}
+
+
+void window_index_appheader(uint8_t *const dest, const xoff_t offset) {
+    int i;
+    
+    memcpy(dest, index_tag, WINDOW_INDEX_LOCATOR_OFFSET);
+    for (i = WINDOW_INDEX_APPHEADER_SIZE - 1; i >= WINDOW_INDEX_LOCATOR_OFFSET; i--)
+        dest[i] = (uint8_t) (offset >> ((WINDOW_INDEX_APPHEADER_SIZE - 1 - i) * 8));
+}
+
+
+int window_index_encode(const window_index_t *const index, uint8_t **const window,
+        usize_t *const size) {
+    uint8_t *const data = malloc(5 + index->count * MAX_INDEX_ENTRY);
+    uint8_t *position = data;
+    uint8_t header[MAX_INDEX_HEADER];
+    uint8_t scratch[10];
+    uint8_t *end = header;
+    usize_t data_size;
+    usize_t header_size;
+    ulong i;
+    
+    if (data == NULL)
+        return ENOMEM;
+    position = write_integer(position, index->count);
+    for (i = 0; i < index->count; i++) {
+        const window_entry_t *const entry = &index->windows[i];
+        position = write_integer(position, entry->delta_offset);
+        position = write_integer(position, entry->target_length);
+        position = write_integer(position, entry->source_offset);
+        position = write_integer(position, entry->source_length);
+    }
+    data_size = (usize_t) (position - data);
+    
+    // The encoding length covers the remainder of the header, starting with
+    // the target window length, and the three sections.
+    *end++ = 0;
+    end = write_integer(end, 3 + (write_integer(scratch, data_size) - scratch)
+            + (write_integer(scratch, data_size * 2) - scratch) + data_size * 3);
+    *end++ = 0;
+    *end++ = 0;
+    end = write_integer(end, data_size);
+    end = write_integer(end, data_size * 2);
+    *end++ = 0;
+    header_size = (usize_t) (end - header);
+    
+    *size = header_size + data_size * 3;
+    if ((*window = malloc(*size)) == NULL) {
+        free(data);
+        return ENOMEM;
+    }
+    memcpy(*window, header, header_size);
+    memcpy(*window + header_size, data, data_size);
+    // Each zero-length run (instruction 0, size 0) consumes one data byte.
+    memset(*window + header_size + data_size, 0, data_size * 2);
+    free(data);
+    return 0;
+}
+
+
+void window_index_free(window_index_t *const index) {
+    free(index->header);
+    free(index->windows);
+    memset(index, 0, sizeof *index);
+}
+
+
+/**
+ * Read an embedded index into an empty index.
+ * 
+ * @param index a pointer to the index to populate.
+ * @param read the function used to read the delta.
+ * @param context a pointer passed to each invocation of read.
+ * @param offset a pointer to the offset of the index window, which is
+ *               updated to the offset of the window that follows it.
+ * @return zero (0) on success; XD3_INTERNAL if read failed; ENOMEM if memory
+ *         could not be allocated; XD3_INVALID_INPUT if the index is invalid.
+ */
+static int read_embedded(window_index_t *const index, window_read_func read,
+        void *const context, xoff_t *const offset) {
+    uint8_t header[MAX_INDEX_HEADER];
+    const uint8_t *position = header;
+    const uint8_t *end;
+    const uint8_t *encoding;
+    uint8_t *data;
+    xoff_t encoding_length;
+    xoff_t data_size;
+    xoff_t value;
+    xoff_t count;
+    xoff_t target_offset = 0;
+    long length;
+    int ret = XD3_INVALID_INPUT;
+    
+    if ((length = read(context, *offset, header, MAX_INDEX_HEADER)) < 0)
+        return XD3_INTERNAL;
+    end = header + length;
+    if ((length < 1) || (*position++ != 0) || !read_integer(&position, end, 5, &encoding_length))
+        return XD3_INVALID_INPUT;
+    encoding = position;
+    if ((end - position < 2) || (*position++ != 0) || (*position++ != 0)
+            || !read_integer(&position, end, 5, &data_size)
+            || !read_integer(&position, end, 5, &value) || (value != data_size * 2)
+            || (position == end) || (*position++ != 0))
+        return XD3_INVALID_INPUT;
+    
+    if ((data = malloc(xd3_max(data_size, 1))) == NULL)
+        return ENOMEM;
+    if ((length = read(context, *offset + (position - header), data, (usize_t) data_size)) < 0) {
+        ret = XD3_INTERNAL;
+        goto exit;
+    }
+    position = data;
+    end = data + length;
+    if (((xoff_t) length != data_size) || !read_integer(&position, end, 10, &count))
+        goto exit;
+    for (; count > 0; count--) {
+        window_entry_t entry;
+        if (!read_integer(&position, end, 10, &entry.delta_offset)
+                || !read_integer(&position, end, 5, &value) || (value > XD3_HARDMAXWINSIZE))
+            goto exit;
+        entry.target_offset = target_offset;
+        entry.target_length = (usize_t) value;
+        if (!read_integer(&position, end, 10, &entry.source_offset)
+                || !read_integer(&position, end, 5, &value) || (value > (usize_t) -1))
+            goto exit;
+        entry.source_length = (usize_t) value;
+        if ((entry.delta_offset >= *offset) || ((index->count > 0)
+                && (entry.delta_offset <= index->windows[index->count - 1].delta_offset)))
+            goto exit;
+        if ((ret = window_index_append(index, &entry)) != 0)
+            goto exit;
+        ret = XD3_INVALID_INPUT;
+        target_offset += entry.target_length;
+    }
+    if (position == end) {
+        *offset += (encoding - header) + encoding_length;
+        ret = 0;
+    }
+    
+exit:
+    free(data);
+    return ret;
+}
+
+
+/**
+ * Decode a variable-length integer, as defined by RFC 3284.
+ * 
+ * @param position a pointer to the position of the first byte, which is
+ *                 advanced past the integer.
+ * @param end the end of the available data.
+ * @param max_bytes the greatest number of bytes the integer may occupy.
+ * @param value a pointer to the location to store the value.
+ * @return true on success; false if the integer is incomplete or too long.
+ */
+static int read_integer(const uint8_t **const position, const uint8_t *const end,
+        const int max_bytes, xoff_t *const value) {
+    const uint8_t *current = *position;
+    xoff_t result = 0;
+    int i;
+    
+    for (i = 0; (i < max_bytes) && (current < end); i++) {
+        const uint8_t next = *current++;
+        result = (result << 7) | (next & 0x7f);
+        if ((next & 0x80) == 0) {
+            *position = current;
+            *value = result;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Encode a variable-length integer, as defined by RFC 3284.
+ * 
+ * @param dest a pointer to the memory to store the integer, which must have
+ *             room for ten (10) bytes.
+ * @param value the value to encode.
+ * @return a pointer to the byte following the integer.
+ */
+static uint8_t *write_integer(uint8_t *dest, const xoff_t value) {
+    int count = 1;
+    int i;
+    
+    while ((count < 10) && ((value >> (7 * count)) != 0))
+        count++;
+    for (i = count - 1; i >= 0; i--)
+        *dest++ = (uint8_t) (((value >> (7 * i)) & 0x7f) | ((i > 0) ? 0x80 : 0));
+    return dest;
+}
@@ -0,0 +1,161 @@
+/* 
+ * File:   window_index.h
+ * Author: Michael Winter <mail@michael-winter.me.uk>
+ *
+ * Created on 16 October 2026, 16:05
+ */
+
+#ifndef WINDOW_INDEX_H
+#define	WINDOW_INDEX_H
+
+#include "config.h"
+
+#include "xdelta3.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+    typedef unsigned long ulong;
+
+    /**
+     * The size of the application header that locates an embedded index,
+     * and the position within it of the offset of the index.
+     */
+#define WINDOW_INDEX_APPHEADER_SIZE 16
+#define WINDOW_INDEX_LOCATOR_OFFSET 8
+
+    /**
+     * The location of a single window within a VCDIFF delta, and of the data
+     * it produces.
+     */
+    typedef struct {
+        /**
+         * The position of the window indicator within the delta.
+         */
+        xoff_t delta_offset;
+        /**
+         * The position of the first byte the window decodes to.
+         */
+        xoff_t target_offset;
+        /**
+         * The number of bytes the window decodes to.
+         */
+        usize_t target_length;
+        /**
+         * The segment of the source referenced by the window; both are zero
+         * (0) if the window does not use the source.
+         */
+        xoff_t source_offset;
+        usize_t source_length;
+    } window_entry_t;
+
+    /**
+     * The file header and windows of a VCDIFF delta.
+     */
+    typedef struct {
+        /**
+         * A copy of the file header, which must precede any window given to a
+         * decoder.
+         */
+        uint8_t *header;
+        usize_t header_size;
+        /**
+         * The windows, in order.
+         */
+        window_entry_t *windows;
+        ulong count;
+        ulong capacity;
+    } window_index_t;
+
+    /**
+     * Read part of a delta.
+     * 
+     * @param context the context pointer passed to window_index_scan.
+     * @param offset the position within the delta to read from.
+     * @param dest a pointer to the memory to store the data.
+     * @param length the number of bytes to read.
+     * @return the number of bytes read, which is less than length only at the
+     *         end of the delta; -1 on error.
+     */
+    typedef long (*window_read_func)(void *context, const xoff_t offset, uint8_t *dest,
+                                     const usize_t length);
+
+    /**
+     * Build an index of the windows in a delta.
+     * 
+     * If the delta embeds an index, that is read first; otherwise, only the
+     * file header and the header of each window are read, the sections of
+     * each window being skipped using the length of the delta encoding
+     * recorded in its header. Windows that follow an embedded index, such as
+     * those written after it became out of date, are scanned in the same way.
+     * 
+     * The index must be released with window_index_free, even on failure.
+     * 
+     * @param index a pointer to the index to populate.
+     * @param read the function used to read the delta.
+     * @param context a pointer passed to each invocation of read.
+     * @return zero (0) on success; XD3_INTERNAL if read failed; ENOMEM if
+     *         memory could not be allocated; XD3_INVALID_INPUT if the delta
+     *         is malformed or truncated; XD3_UNIMPLEMENTED if it uses
+     *         features the decoder does not support.
+     */
+    int window_index_scan(window_index_t *const index, window_read_func read,
+                          void *const context);
+
+    /**
+     * Add a window to the end of an index.
+     * 
+     * @param index a pointer to the index to extend.
+     * @param entry a pointer to the window to add.
+     * @return zero (0) on success; ENOMEM if memory could not be allocated.
+     */
+    int window_index_append(window_index_t *const index, const window_entry_t *const entry);
+
+    /**
+     * Produce the application header that locates an embedded index.
+     * 
+     * The header should be given to the encoder with an offset of zero (0),
+     * before any output is produced. Once an index has been written, the
+     * WINDOW_INDEX_APPHEADER_SIZE - WINDOW_INDEX_LOCATOR_OFFSET bytes from
+     * WINDOW_INDEX_LOCATOR_OFFSET onwards can be overwritten in the output
+     * with those for its offset.
+     * 
+     * @param dest a pointer to WINDOW_INDEX_APPHEADER_SIZE bytes of memory.
+     * @param offset the offset of the embedded index within the delta; zero
+     *               (0) if there is none.
+     */
+    void window_index_appheader(uint8_t *const dest, const xoff_t offset);
+
+    /**
+     * Encode an index as a window to be appended to a delta.
+     * 
+     * The window decodes to nothing: its data section holds the index, and
+     * its instruction section consists of zero-length runs that consume
+     * the data a byte at a time, so decoders that do not recognise it can
+     * still read the delta.
+     * 
+     * @param index a pointer to the index to encode.
+     * @param window a pointer to the location to store a pointer to the
+     *               window, which must be released with free.
+     * @param size a pointer to the location to store the size of the window.
+     * @return zero (0) on success; ENOMEM if memory could not be allocated.
+     */
+    int window_index_encode(const window_index_t *const index, uint8_t **const window,
+                            usize_t *const size);
+
+    /**
+     * Release the memory held by an index.
+     * 
+     * @param index a pointer to the index to release.
+     */
+    void window_index_free(window_index_t *const index);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* WINDOW_INDEX_H */
@@ -1,4 +1,11 @@
+import bisect
+import collections
+import io
+import posixpath
+import threading
+
 import django.core.files as files
+import django.core.files.storage as storage
 
 import _xdelta
 
@@ -36,32 +43,156 @@ class DeltaFile(files.File):
 
     It should be noted that while multiple DeltaFile objects may be chained by setting an existing instance to be the
     source file of another, this may result in high memory consumption as these files will need to be decoded
-    on-the-fly in order to provide the necessary decoded data.
+    on-the-fly in order to provide the necessary decoded data. A chain of deltas can instead be combined with
+    _xdelta.merge into a single delta against the oldest source, which is decoded in one pass.
+
+    Encoding can be tuned by passing keyword arguments to the constructor, trading compression ratio for speed:
+
+        level           The compression level, from 0 (none) to 9 (best, the default).
+        matcher         The string matching preset: 'fastest', 'faster', 'fast', 'default' or 'slow'. By default,
+                        this is chosen to suit the level.
+        secondary       The secondary compressor: 'none', 'djw' (the default) or 'fgk'.
+        winsize         The size of each encoded window of data; 8 MB by default.
+        source_winsize  How much of the source file is considered for matches and cached; 64 MB by default.
+        cache_blocks    The number of blocks the source cache is divided into; 32 by default. Blocks are allocated as
+                        they are used, are smaller for a source of known size smaller than source_winsize, and are
+                        limited overall by _xdelta.set_cache_budget.
+        cache_policy    The retention policy of the source cache: 'lru' (the default) or '2q', which keeps frequently
+                        used blocks when a large part of the source is read once. Hit ratios are reported in stats.
+        compressed_cache
+                        The size in bytes of a second tier that keeps blocks evicted from the source cache in compressed
+                        form, so that they need not be read from the source again; 0 (disabled) by default.
+        index           If True, an index of the encoded windows is embedded in the file when it is flushed, so that
+                        seeking does not need to scan the file; False by default. Other decoders ignore the index.
+                        Every flush writes a complete index of the windows so far, so the file should be flushed
+                        once, when it is finished; each extra flush repeats all of the earlier entries.
+        source_key      A string identifying the content of the source, which must change whenever the content does.
+                        DeltaFiles with the same key share cached source blocks through a process-wide cache, sized
+                        with _xdelta.set_shared_cache_capacity and counted against _xdelta.set_cache_budget. It cannot
+                        be combined with cache_policy or compressed_cache.
+
+    For example:
 
-    Use of built-in file object methods, such as seek and readline, may result in undefined behaviour and should be
-    avoided.
+        with DeltaFile(target, level=1, secondary='none') as df:
+            df.write(data)
+
+    When the underlying file is seekable, decoded data can be read from any position using seek and tell, or read_range.
+    Only the windows of the delta that contain the requested data are decoded, after an index of the windows has been
+    built from their headers. Use of other built-in file object methods, such as readline, may result in undefined
+    behaviour and should be avoided.
     """
     DEFAULT_CHUNK_SIZE = 8 * 2**20
     """Default chunks to 8 MB."""
 
-    def __init__(self, file, name=None):
+    def __init__(self, file, name=None, **options):
         super(DeltaFile, self).__init__(file, name)
+        self._options = options
         self._stream = None
+        self._source_start = None
+        self._position = 0
+        self._restart = False
+        self._index = None
 
     def _get_source(self):
         """The file against which differences will be calculated during encoding."""
         return self._stream.source if self._stream else None
 
     def _set_source(self, source):
+        try:
+            self._source_start = source.tell()
+        except (AttributeError, IOError):
+            self._source_start = None
         if not self._stream:
-            self._stream = _xdelta.Stream(self.file, source)
+            self._stream = _xdelta.Stream(self.file, source, **self._options)
         else:
             self._stream.source = source
     source = property(_get_source, _set_source)
 
+    @property
+    def stats(self):
+        """
+        Performance counters for the current encoding or decoding, as a dict; None if neither has started.
+
+        The counters separate the time spent in the xdelta engine from the time spent reading and writing files and
+        fetching source data, and report source cache hits and misses, bytes processed and windows completed. See
+        _xdelta.Stream.stats for details.
+        """
+        return self._stream.stats if self._stream else None
+
+    @property
+    def decoded_size(self):
+        """
+        The size of the decoded content, determined without decoding.
+
+        The target length of every window is taken from the embedded index, if there is one, or otherwise from the
+        window headers. AttributeError is raised if the underlying file is not seekable, as the headers cannot then be
+        read ahead of decoding, and IOError if it is not empty but does not yet hold a complete delta.
+        """
+        if not self.seekable():
+            raise AttributeError('the decoded size of a file that is not seekable is unknown')
+        position = self.file.tell()
+        self.file.seek(0, io.SEEK_END)
+        empty = self.file.tell() == 0
+        self.file.seek(position)
+        return 0 if empty else self._get_index()[3]
+
     def open(self, mode=None):
+        # File.open rewinds an open file through seek, which now refers to the decoded data.
+        if not self.closed:
+            self.file.seek(0)
+        self._position = 0
         super(DeltaFile, self).open(mode)
-        self._stream = _xdelta.Stream(self.file, self._stream.source)
+        self._stream = self._new_stream(self.file)
+        self._restart = False
+        self._index = None
+
+    def seekable(self):
+        """
+        Returns True if decoded data can be read from any position, which requires the underlying file to be seekable.
+        """
+        try:
+            return self.file.seekable()
+        except AttributeError:
+            return hasattr(self.file, 'seek') and hasattr(self.file, 'tell')
+
+    def seek(self, offset, whence=io.SEEK_SET):
+        """
+        Change the position from which decoded data will be read, and return the new position.
+
+        The offset is interpreted relative to the position indicated by whence: the start of the decoded data
+        (SEEK_SET, the default), the current position (SEEK_CUR) or the end of the decoded data (SEEK_END). Decoding
+        resumes from the window containing the new position when data is next read.
+        """
+        if not self.seekable():
+            raise io.UnsupportedOperation('the underlying file is not seekable')
+        if whence == io.SEEK_CUR:
+            offset += self._position
+        elif whence == io.SEEK_END:
+            offset += self._get_index()[3]
+        elif whence != io.SEEK_SET:
+            raise ValueError('invalid whence ({0}, should be 0, 1 or 2)'.format(whence))
+        if offset < 0:
+            raise IOError('negative seek position {0}'.format(offset))
+        if offset != self._position:
+            self._position = offset
+            self._restart = True
+        return offset
+
+    def tell(self):
+        """
+        Return the current position within the decoded data.
+        """
+        return self._position
+
+    def read_range(self, start, stop):
+        """
+        Read the decoded content from position start up to, but not including, stop.
+
+        Only the windows of the delta that contain the range are decoded. The position is left at the end of the
+        content read.
+        """
+        self.seek(start)
+        return self.read(max(stop - start, 0))
 
     def read(self, num_bytes=-1):
         """
@@ -69,9 +200,61 @@ class DeltaFile(files.File):
 
         The optional size is the number of bytes to read; if not specified, the file will be read to the end.
         """
-        if not self._stream:
-            self._stream = _xdelta.Stream(self.file)
-        return self._stream.read(num_bytes)
+        data = self._get_read_stream().read(num_bytes)
+        self._position += len(data)
+        return data
+
+    def readinto(self, buffer):
+        """
+        Read content from the file directly into a writable buffer, such as a bytearray or mmap.
+
+        At most len(buffer) bytes are read. Returns the number of bytes stored, which is zero at the end of the file.
+        """
+        count = self._get_read_stream().readinto(buffer)
+        self._position += count
+        return count
+
+    def chunks(self, chunk_size=None):
+        """
+        Read the file from the start, yielding the decoded content as a sequence of byte strings of at most chunk_size
+        bytes (DEFAULT_CHUNK_SIZE by default). Each is copied from a single decoded window. If the underlying file is
+        not seekable, content is read from the current position instead.
+        """
+        chunk_size = chunk_size or self.DEFAULT_CHUNK_SIZE
+        windows = self.iter_windows()
+        for window in windows:
+            chunks = [window[start:start + chunk_size].tobytes() for start in range(0, len(window), chunk_size)]
+            # The window must be released before the next is decoded.
+            del window
+            for chunk in chunks:
+                yield chunk
+
+    def iter_windows(self):
+        """
+        Read the file from the start, yielding the decoded content of each window as a read-only memoryview.
+
+        Each view refers directly to the decoder's buffer, without copying, so it must be released (by deleting every
+        reference to it) before the next is requested; BufferError is raised otherwise. Call tobytes to keep the
+        content. If the underlying file is not seekable, content is read from the current position instead.
+        """
+        try:
+            self.seek(0)
+        except (AttributeError, io.UnsupportedOperation):
+            pass
+        for window in self._get_read_stream().iter_windows():
+            self._position += len(window)
+            yield window
+            del window
+
+    def __iter__(self):
+        partial = b''
+        for chunk in self.chunks():
+            lines = (partial + chunk).splitlines(True)
+            partial = lines.pop() if lines and not lines[-1].endswith((b'\n', b'\r')) else b''
+            for line in lines:
+                yield line
+        if partial:
+            yield partial
 
     def write(self, content):
         """
@@ -81,16 +264,18 @@ class DeltaFile(files.File):
         called on the file.
         """
         if not self._stream:
-            self._stream = _xdelta.Stream(self.file)
+            self._stream = _xdelta.Stream(self.file, **self._options)
         self._stream.write(content)
+        self._index = None
 
     def flush(self):
         """
         Write any pending data to output.
         """
         if not self._stream:
-            self._stream = _xdelta.Stream(self.file)
+            self._stream = _xdelta.Stream(self.file, **self._options)
         self._stream.flush()
+        self._index = None
         super(DeltaFile, self).flush()
 
     def close(self):
@@ -100,6 +285,60 @@ class DeltaFile(files.File):
         self.source = None
         super(DeltaFile, self).close()
 
+    def _new_stream(self, file):
+        """
+        Create a stream for the given file using the current source, which is first returned to the position it had
+        when it was assigned.
+        """
+        source = self.source
+        if source is not None and self._source_start is not None:
+            source.seek(self._source_start)
+        return _xdelta.Stream(file, source, **self._options)
+
+    def _get_read_stream(self):
+        """
+        Return the stream to read from, restarting decoding at the current position after a seek.
+        """
+        if self._restart:
+            self._stream = self._seek_stream()
+            self._restart = False
+        elif not self._stream:
+            self._stream = _xdelta.Stream(self.file, **self._options)
+        return self._stream
+
+    def _get_index(self):
+        """
+        Return the header of the delta, its windows, the decoded position of each window and the decoded size.
+
+        The index is built on first use from the window headers of the underlying file, which is read from its start.
+        """
+        if self._index is None:
+            position = self.file.tell()
+            self.file.seek(0)
+            try:
+                header, windows = _xdelta.scan_windows(self.file)
+            finally:
+                self.file.seek(position)
+            offsets = [target_offset for _, target_offset, _ in windows]
+            size = windows[-1][1] + windows[-1][2] if windows else 0
+            self._index = (header, windows, offsets, size)
+        return self._index
+
+    def _seek_stream(self):
+        """
+        Create a stream that decodes from the window containing the current position, having skipped any data that
+        precedes the position within that window.
+        """
+        header, windows, offsets, size = self._get_index()
+        if self._position >= size:
+            return self._new_stream(_WindowReader(self.file, header, None))
+        number = bisect.bisect_right(offsets, self._position) - 1
+        stream = self._new_stream(_WindowReader(self.file, header, windows[number][0]))
+        skip = self._position - offsets[number]
+        if skip:
+            stream.read(skip)
+        return stream
+
     def multiple_chunks(self, chunk_size=None):
         """
         Returns True if the file is large enough to require multiple chunks to access all of its content given some
@@ -109,7 +348,222 @@ class DeltaFile(files.File):
             chunk_size = self.DEFAULT_CHUNK_SIZE
         try:
             return self.decoded_size > chunk_size
-        except AttributeError:
+        except (AttributeError, IOError):
             # If the decoded size is not available, the encoded size may still provide a clue as to the viability of
             # chunking.
             return super(DeltaFile, self).multiple_chunks(chunk_size)
+
+
+class DeltaStorage(storage.Storage):
+    """
+    The DeltaStorage class keeps every revision of each file it stores, delta-compressed, in another storage.
+
+    Saving a file under an existing name adds a revision rather than choosing a new name. Each revision is normally
+    stored as a DeltaFile encoded against the previous revision. Every so often a keyframe is stored instead---a
+    revision compressed without a source---so that reading any revision never decodes more than a bounded number of
+    files. Recently read or written revisions are cached, so reading a revision starts from the nearest cached one
+    where possible.
+
+        storage = DeltaStorage(FileSystemStorage(location='/var/revisions'))
+        storage.save('report.txt', ContentFile(first))
+        storage.save('report.txt', ContentFile(second))
+        # Read the latest revision.
+        with storage.open('report.txt') as f:
+            data = f.read()
+        # Read an earlier revision.
+        with storage.open_revision('report.txt', 0) as f:
+            data = f.read()
+
+    The constructor accepts the following keyword arguments:
+
+        storage             The storage that holds the revisions; the default storage if omitted. The revisions of a
+                            file named name are stored as name.revisions/NNNNNNNN.key for keyframes and
+                            name.revisions/NNNNNNNN.delta for deltas, numbered from zero.
+        keyframe_interval   The maximum number of revisions decoded to read any revision; 16 by default. A keyframe is
+                            stored once the previous keyframe is followed by this many revisions less one.
+        keyframe_threshold  If given, a keyframe is also stored once the deltas since the previous keyframe total at
+                            least this many bytes.
+        cache_size          The number of revisions kept in memory once read or written; 8 by default.
+
+    Other keyword arguments tune the encoder as they do for DeltaFile.
+    """
+    REVISIONS_SUFFIX = '.revisions'
+    KEYFRAME_EXTENSION = 'key'
+    DELTA_EXTENSION = 'delta'
+
+    def __init__(self, storage=None, keyframe_interval=16, keyframe_threshold=None, cache_size=8, **options):
+        if keyframe_interval < 1:
+            raise ValueError('keyframe_interval must be positive')
+        if storage is None:
+            from django.core.files.storage import default_storage as storage
+        self._storage = storage
+        self._keyframe_interval = keyframe_interval
+        self._keyframe_threshold = keyframe_threshold
+        self._cache_size = cache_size
+        self._cache = collections.OrderedDict()
+        self._lock = threading.Lock()
+        self._options = options
+
+    def revisions(self, name):
+        """
+        Return the number of revisions stored for the named file.
+        """
+        return len(self._list_revisions(name))
+
+    def open_revision(self, name, revision):
+        """
+        Return a File containing the given revision of the named file; negative revisions count back from the latest.
+        """
+        revisions = self._list_revisions(name)
+        if not -len(revisions) <= revision < len(revisions):
+            raise IOError('{0} has no revision {1}'.format(name, revision))
+        return files.File(io.BytesIO(self._materialize(name, revisions, revision % len(revisions))), name)
+
+    def get_available_name(self, name, max_length=None):
+        # Saving an existing name adds a revision, so every name is available.
+        return name
+
+    def exists(self, name):
+        return bool(self._list_revisions(name))
+
+    def delete(self, name):
+        for number, keyframe in self._list_revisions(name):
+            self._storage.delete(self._revision_path(name, number, keyframe))
+        with self._lock:
+            for key in [key for key in self._cache if key[0] == name]:
+                del self._cache[key]
+
+    def size(self, name):
+        revisions = self._list_revisions(name)
+        if not revisions:
+            raise IOError('{0} does not exist'.format(name))
+        number, keyframe = revisions[-1]
+        with DeltaFile(self._storage.open(self._revision_path(name, number, keyframe))) as delta:
+            try:
+                return delta.decoded_size
+            except (AttributeError, IOError):
+                pass
+        with self.open(name) as f:
+            return len(f.read())
+
+    def _open(self, name, mode='rb'):
+        if any(c in mode for c in 'wa+'):
+            raise ValueError('revisions cannot be modified; save a new revision instead')
+        return self.open_revision(name, -1)
+
+    def _save(self, name, content):
+        data = b''.join(content.chunks())
+        revisions = self._list_revisions(name)
+        number = len(revisions)
+        keyframe = self._needs_keyframe(name, revisions)
+        output = io.BytesIO()
+        delta = DeltaFile(output, **self._options)
+        if not keyframe:
+            delta.source = io.BytesIO(self._materialize(name, revisions, number - 1))
+        delta.write(data)
+        delta.flush()
+        output.seek(0)
+        path = self._revision_path(name, number, keyframe)
+        saved = self._storage.save(path, files.File(output))
+        if saved.replace('\\', '/') != path:
+            # Another save took this revision number first, so this delta is against the wrong revision.
+            self._storage.delete(saved)
+            raise IOError('revision {0} of {1} was saved concurrently'.format(number, name))
+        self._cache_put((name, number), data)
+        return name
+
+    def _list_revisions(self, name):
+        """
+        Return a list of (number, keyframe) tuples, one for each revision of the named file in order.
+        """
+        path = name + self.REVISIONS_SUFFIX
+        if not self._storage.exists(path):
+            return []
+        revisions = []
+        for filename in self._storage.listdir(path)[1]:
+            number, _, extension = filename.partition('.')
+            if number.isdigit() and extension in (self.KEYFRAME_EXTENSION, self.DELTA_EXTENSION):
+                revisions.append((int(number), extension == self.KEYFRAME_EXTENSION))
+        revisions.sort()
+        return revisions
+
+    def _revision_path(self, name, number, keyframe):
+        extension = self.KEYFRAME_EXTENSION if keyframe else self.DELTA_EXTENSION
+        return posixpath.join(name + self.REVISIONS_SUFFIX, '{0:08d}.{1}'.format(number, extension))
+
+    def _needs_keyframe(self, name, revisions):
+        """
+        Return True if the next revision should be stored as a keyframe.
+        """
+        if not revisions:
+            return True
+        start = max(i for i, (_, keyframe) in enumerate(revisions) if keyframe)
+        if len(revisions) - start >= self._keyframe_interval:
+            return True
+        if self._keyframe_threshold is not None:
+            deltas = revisions[start + 1:]
+            total = sum(self._storage.size(self._revision_path(name, number, False)) for number, _ in deltas)
+            return total >= self._keyframe_threshold
+        return False
+
+    def _materialize(self, name, revisions, revision):
+        """
+        Return the content of a revision, decoding it from the nearest cached revision or the keyframe before it.
+        """
+        start = max(i for i, (_, keyframe) in enumerate(revisions[:revision + 1]) if keyframe)
+        data = None
+        for number in range(revision, start - 1, -1):
+            data = self._cache_get((name, number))
+            if data is not None:
+                start = number + 1
+                break
+        for number in range(start, revision + 1):
+            keyframe = revisions[number][1]
+            with DeltaFile(self._storage.open(self._revision_path(name, number, keyframe))) as delta:
+                if not keyframe:
+                    delta.source = io.BytesIO(data)
+                data = delta.read()
+            self._cache_put((name, number), data)
+        return data
+
+    def _cache_get(self, key):
+        with self._lock:
+            data = self._cache.pop(key, None)
+            if data is not None:
+                self._cache[key] = data
+            return data
+
+    def _cache_put(self, key, data):
+        with self._lock:
+            self._cache.pop(key, None)
+            self._cache[key] = data
+            while len(self._cache) > self._cache_size:
+                self._cache.popitem(last=False)
+
+
+class _WindowReader(object):
+    """
+    Presents the header of a delta followed by its windows from a given offset, so that decoding can begin at any
+    window. An offset of None presents the header alone.
+    """
+
+    def __init__(self, file, header, offset):
+        self._file = file
+        self._header = header
+        self._offset = offset
+        self._positioned = False
+
+    def read(self, size=-1):
+        data = self._header if size < 0 else self._header[:size]
+        self._header = self._header[len(data):]
+        if size >= 0:
+            size -= len(data)
+        if self._offset is not None and size != 0:
+            if not self._positioned:
+                self._file.seek(self._offset)
+                self._positioned = True
+            data += self._file.read(size)
+        return data
+
+    def write(self, data):
+        raise IOError('a delta being decoded cannot be written')
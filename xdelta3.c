@@ -266,6 +266,9 @@
 
 #include "xdelta3.h"
 #include "xdelta3-internal.h"
+#if SIMD_MATCH
+#include "match_kernel.h"
+#endif
 
 /***********************************************************************
  STATIC CONFIGURATION
@@ -738,6 +741,33 @@ const xd3_sec_type lzma_sec_type =
 
 #if XD3_MAIN || PYTHON_MODULE || SWIG_MODULE || NOT_MAIN
 #include "xdelta3-main.h"
+#elif XD3_ENCODER
+/* Library builds take the VCDIFF merge routines without the command line
+ * tool that otherwise includes them. Their diagnostics are printed by the
+ * tool, so are discarded here; errors are still returned. */
+#undef XPR
+#define XPR(...) ((void) 0)
+#include "xdelta3-merge.h"
+#undef XPR
+#define XPR xprintf
+
+/* Entry points for merge drivers outside this file, which cannot reach the
+ * static routines they need. */
+int xd3_merge_whole_init (xd3_stream *stream)
+{
+  return xd3_whole_state_init (stream);
+}
+
+void xd3_merge_whole_swap (xd3_whole_state *a, xd3_whole_state *b)
+{
+  xd3_swap_whole_state (a, b);
+}
+
+int xd3_merge_emit_run (xd3_stream *stream, usize_t pos, usize_t size,
+			uint8_t *run_c)
+{
+  return xd3_emit_run (stream, pos, size, run_c);
+}
 #endif
 
 #if REGRESSION_TEST
@@ -3877,6 +3907,10 @@ xd3_source_match_setup (xd3_stream *stream, xoff_t srcpos)
 static inline int
 xd3_forward_match(const uint8_t *s1c, const uint8_t *s2c, int n)
 {
+#if SIMD_MATCH
+  /* Vector kernels chosen for the processor at run time. */
+  return (int) match_forward (s1c, s2c, (size_t) n);
+#else
   int i = 0;
 #if UNALIGNED_OK
   int nint = n / sizeof(int);
@@ -3907,6 +3941,7 @@ xd3_forward_match(const uint8_t *s1c, const uint8_t *s2c, int n)
       i++;
     }
   return i;
+#endif
 }
 
 /* This function expands the source match backward and forward.  It is
@@ -3983,6 +4018,20 @@ xd3_source_extend_match (xd3_stream *stream)
 	  IF_DEBUG2(DP(RINT "[maxback] maxback %u trysrc %"Q"u/%u tgt %u tryrem %u\n",
 		       stream->match_maxback, tryblk, tryoff, streamoff, tryrem));
 
+#if SIMD_MATCH
+	  /* Compare the whole span within this block at once. */
+	  matched = (usize_t) match_backward (src->curblk + tryoff,
+					      stream->next_in + streamoff,
+					      (size_t) tryrem);
+	  tryoff    -= matched;
+	  streamoff -= matched;
+	  stream->match_back += matched;
+
+	  if (tryrem != matched)
+	    {
+	      goto doneback;
+	    }
+#else
 	  /* TODO: This code can be optimized similar to xd3_match_forward() */
 	  for (; tryrem != 0; tryrem -= 1, stream->match_back += 1)
 	    {
@@ -3994,6 +4043,7 @@ xd3_source_extend_match (xd3_stream *stream)
 	      tryoff    -= 1;
 	      streamoff -= 1;
 	    }
+#endif
 	}
 
     doneback:
@@ -4233,11 +4283,15 @@ xd3_smatch (xd3_stream *stream,
   SMALL_HASH_DEBUG2 (stream, ref);
 
   /* Expand potential match forward. */
+#if SIMD_MATCH
+  inp += match_forward (inp, ref, (size_t) (inp_max - inp));
+#else
   while (inp < inp_max && *inp == *ref)
     {
       ++inp;
       ++ref;
     }
+#endif
 
   cmp_len = (usize_t)(inp - (stream->next_in + stream->input_position));
 